@@ -0,0 +1,46 @@
+#!/bin/sh
+# Checks that run without the sensors or an audio device. Give it a built finger binary:
+#
+#   checks/run-checks.sh path/to/finger
+#
+# render.session is a short session (see --record-session) and render.wav is what it rendered to.
+# remote.session is the same playing with notes from a jam peer added, some of them late or unsynced; it is
+# rendered once through the effects (cabinet.wav is a made-up cabinet) into effects.wav, and once with the
+# metronome clicking into click.wav. When a change to the sound is meant, render them again with --render and
+# the options below, and commit the new WAVs with the change. Exits non-zero if any check fails.
+
+if [ $# -ne 1 ]; then
+    echo "usage: $0 <finger binary>" >&2
+    exit 2
+fi
+finger=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+checks=$(cd "$(dirname "$0")" && pwd)
+# The note WAVs are looked for in the working directory.
+cd "$checks/.."
+
+failed=0
+check() {
+    name=$1
+    shift
+    # finger waits for enter after an error; don't let it.
+    if "$finger" "$@" < /dev/null; then
+        echo "PASS $name"
+    else
+        echo "FAIL $name"
+        failed=1
+    fi
+}
+
+effects="--drive 12 --cabinet $checks/cabinet.wav --reverb 0.3:1.5"
+click="--metronome 150:4 --click 0.5"
+
+check render --check-render "$checks/render.session" "$checks/render.wav"
+check effects $effects --check-render "$checks/remote.session" "$checks/effects.wav"
+check click $click --check-render "$checks/remote.session" "$checks/click.wav"
+# The same sessions again, failing if the mixer allocates, frees or locks while rendering them.
+check realtime --check-realtime "$checks/render.session"
+check realtime-effects $effects $click --check-realtime "$checks/remote.session"
+# The play loop, failing if it allocates, frees or locks.
+check allocations --check-allocations
+
+exit $failed
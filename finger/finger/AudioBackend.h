@@ -0,0 +1,443 @@
+#ifndef FINGER_AUDIOBACKEND_H
+#define FINGER_AUDIOBACKEND_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <SFML/Audio.hpp>
+#include "Clock.h"
+#include "Mixer.h"
+
+// The ALSA backend (and the ALSA sequencer output in Midi.h) is only built when the build defines
+// FINGER_ALSA, which it should do on Linux when libasound and its headers are there; link with -lasound.
+#ifdef FINGER_ALSA
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <alsa/asoundlib.h>
+#endif
+
+// Plays a Mixer on an output device. Each backend owns the audio thread: it asks the mixer for a block with
+// Mixer::renderBlock() whenever the device has room, telling it when that block will be heard.
+class AudioBackend {
+public:
+    virtual ~AudioBackend() {
+    }
+
+    virtual const char* name() const = 0;
+
+    virtual void start() = 0;
+    virtual void stop() = 0;
+
+    // Any thread: mixer frames the device has played so far, i.e. the frame at the output right now as far
+    // as the API can tell.
+    virtual uint64_t playedFrames() const = 0;
+};
+
+// Through sf::SoundStream, which sits on OpenAL. SFML keeps streamBuffers blocks queued and refills one
+// from its own thread each time one finishes, so the output lags the mixer by all but the one being
+// refilled.
+class SfmlBackend : public AudioBackend {
+public:
+    SfmlBackend(Mixer& mixer, const MixerConfig& config)
+    : stream(mixer, config)
+    {
+    }
+
+    virtual const char* name() const {
+        return "sfml";
+    }
+
+    virtual void start() {
+        stream.play();
+    }
+
+    virtual void stop() {
+        stream.stop();
+    }
+
+    virtual uint64_t playedFrames() const {
+        return (uint64_t) stream.getPlayingOffset().asMicroseconds() * mixerSampleRate / 1000000;
+    }
+
+private:
+    class Stream : public sf::SoundStream {
+    public:
+        Stream(Mixer& mixer, const MixerConfig& config)
+        : mixer(mixer), config(config), output(config.blockFrames * mixerChannels)
+        {
+            initialize(mixerChannels, mixerSampleRate);
+        }
+
+        ~Stream() {
+            stop();
+        }
+
+    protected:
+        virtual bool onGetData(Chunk& data) {
+            // This block starts playing once the buffers already queued ahead of it have played out. SFML
+            // queues its own fixed number, whatever the config asked for.
+            int64_t blockMicros = (int64_t) config.blockFrames * 1000000 / mixerSampleRate;
+            mixer.renderBlock(&output[0], config.blockFrames,
+                              hostMicros() + (streamBuffers - 1) * blockMicros);
+            data.samples = &output[0];
+            data.sampleCount = config.blockFrames * mixerChannels;
+            return true;
+        }
+
+        virtual void onSeek(sf::Time) {
+        }
+
+    private:
+        Mixer& mixer;
+        MixerConfig config;
+        std::vector<sf::Int16> output;
+    };
+
+    Stream stream;
+};
+
+#ifdef FINGER_ALSA
+// Straight to an ALSA PCM device in mmap mode: the mixer renders into the device's own ring buffer, with no
+// copy and no sound server in between unless the device is one (the "pipewire" and "pulse" PCMs are, for
+// comparison). The ring holds queuedBuffers periods of blockFrames; the thread sleeps in snd_pcm_wait()
+// until a period is free and fills it.
+class AlsaBackend : public AudioBackend {
+public:
+    AlsaBackend(Mixer& mixer, const MixerConfig& config, const std::string& device = "default")
+    : mixer(mixer), pcm(NULL), period(0), running(false), written(0), played(0), playedAt(0)
+    {
+        int error = snd_pcm_open(&pcm, device.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
+        if (error < 0) {
+            throw std::runtime_error("Unable to open ALSA device " + device + ": " + snd_strerror(error));
+        }
+        snd_pcm_hw_params_t* hw;
+        snd_pcm_hw_params_alloca(&hw);
+        snd_pcm_uframes_t periodFrames = config.blockFrames;
+        snd_pcm_uframes_t bufferFrames = (snd_pcm_uframes_t) config.blockFrames * config.queuedBuffers;
+        unsigned int rate = mixerSampleRate;
+        if (snd_pcm_hw_params_any(pcm, hw) < 0 ||
+            snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0 ||
+            snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16) < 0 ||
+            snd_pcm_hw_params_set_channels(pcm, hw, mixerChannels) < 0 ||
+            snd_pcm_hw_params_set_rate_near(pcm, hw, &rate, NULL) < 0 || rate != mixerSampleRate ||
+            snd_pcm_hw_params_set_period_size_near(pcm, hw, &periodFrames, NULL) < 0 ||
+            snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &bufferFrames) < 0 ||
+            snd_pcm_hw_params(pcm, hw) < 0) {
+            snd_pcm_close(pcm);
+            throw std::runtime_error("ALSA device " + device +
+                                     " can't play mmap 16-bit stereo at the mixer rate");
+        }
+        period = periodFrames;
+        buffer = bufferFrames;
+
+        // Start once the ring is full, and wake when a period is free.
+        snd_pcm_sw_params_t* sw;
+        snd_pcm_sw_params_alloca(&sw);
+        if (snd_pcm_sw_params_current(pcm, sw) < 0 ||
+            snd_pcm_sw_params_set_start_threshold(pcm, sw, buffer) < 0 ||
+            snd_pcm_sw_params_set_avail_min(pcm, sw, period) < 0 ||
+            snd_pcm_sw_params(pcm, sw) < 0) {
+            snd_pcm_close(pcm);
+            throw std::runtime_error("Unable to configure ALSA device " + device);
+        }
+    }
+
+    ~AlsaBackend() {
+        stop();
+        snd_pcm_close(pcm);
+    }
+
+    virtual const char* name() const {
+        return "alsa";
+    }
+
+    virtual void start() {
+        if (!running) {
+            running = true;
+            thread = std::thread(&AlsaBackend::run, this);
+        }
+    }
+
+    virtual void stop() {
+        if (running) {
+            running = false;
+            thread.join();
+            snd_pcm_drop(pcm);
+        }
+    }
+
+    // Extrapolated from the last position the audio thread read, up to what has been written.
+    virtual uint64_t playedFrames() const {
+        uint64_t at = played.load(std::memory_order_acquire);
+        int64_t since = hostMicros() - playedAt.load(std::memory_order_relaxed);
+        uint64_t frames = at + (uint64_t) (since > 0 ? since : 0) * mixerSampleRate / 1000000;
+        uint64_t limit = written.load(std::memory_order_relaxed);
+        return frames < limit ? frames : limit;
+    }
+
+private:
+    void run() {
+        // Ask for real-time scheduling; without the privilege this fails and the thread runs as it is.
+        sched_param param;
+        param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+        while (running) {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+            if (avail < 0) {
+                recover((int) avail);
+                continue;
+            }
+            if ((snd_pcm_uframes_t) avail < period) {
+                int error = snd_pcm_wait(pcm, 100);
+                if (error < 0) {
+                    recover(error);
+                }
+                continue;
+            }
+
+            // Frames still queued ahead of the ones about to be written, which play first.
+            snd_pcm_sframes_t delay = 0;
+            if (snd_pcm_delay(pcm, &delay) < 0 || delay < 0) {
+                delay = 0;
+            }
+            int64_t now = hostMicros();
+            publish(delay, now);
+
+            const snd_pcm_channel_area_t* areas;
+            snd_pcm_uframes_t offset;
+            snd_pcm_uframes_t frames = period;
+            int error = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+            if (error < 0) {
+                recover(error);
+                continue;
+            }
+            // Interleaved, so the first channel's area covers every channel. Near the end of the ring the
+            // area may be short; the rest comes on the next pass.
+            const snd_pcm_channel_area_t& area = areas[0];
+            sf::Int16* out = (sf::Int16*) ((char*) area.addr + (area.first + offset * area.step) / 8);
+            mixer.renderBlock(out, (int) frames, now + (int64_t) delay * 1000000 / mixerSampleRate);
+            snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, frames);
+            if (committed < 0 || (snd_pcm_uframes_t) committed != frames) {
+                recover(committed < 0 ? (int) committed : -EPIPE);
+                continue;
+            }
+            written.fetch_add(frames, std::memory_order_relaxed);
+        }
+    }
+
+    void publish(snd_pcm_sframes_t delay, int64_t now) {
+        uint64_t total = written.load(std::memory_order_relaxed);
+        playedAt.store(now, std::memory_order_relaxed);
+        played.store(total > (uint64_t) delay ? total - (uint64_t) delay : 0, std::memory_order_release);
+    }
+
+    // After an underrun (or a suspend) the device is prepared again and refills from empty; the mixer's
+    // callback gap accounting counts the underrun.
+    void recover(int error) {
+        if (snd_pcm_recover(pcm, error, 1) < 0) {
+            snd_pcm_prepare(pcm);
+        }
+    }
+
+    Mixer& mixer;
+    snd_pcm_t* pcm;
+    snd_pcm_uframes_t period;
+    snd_pcm_uframes_t buffer;
+    std::atomic<bool> running;
+    std::thread thread;
+    // Frames handed to the device, and the latest estimate of how many it had played and when.
+    std::atomic<uint64_t> written;
+    std::atomic<uint64_t> played;
+    std::atomic<int64_t> playedAt;
+};
+#endif
+
+// No device: a thread renders a block every block period into a scratch buffer and the block counts as
+// played as soon as it is rendered. For timing the mixer on its own, and as the floor the other backends'
+// latency is measured against.
+class NullBackend : public AudioBackend {
+public:
+    NullBackend(Mixer& mixer, const MixerConfig& config)
+    : mixer(mixer), blockFrames(config.blockFrames), output(config.blockFrames * mixerChannels),
+      running(false), rendered(0)
+    {
+    }
+
+    ~NullBackend() {
+        stop();
+    }
+
+    virtual const char* name() const {
+        return "null";
+    }
+
+    virtual void start() {
+        if (!running) {
+            running = true;
+            thread = std::thread(&NullBackend::run, this);
+        }
+    }
+
+    virtual void stop() {
+        if (running) {
+            running = false;
+            thread.join();
+        }
+    }
+
+    virtual uint64_t playedFrames() const {
+        return rendered.load(std::memory_order_acquire);
+    }
+
+private:
+    void run() {
+        std::chrono::microseconds blockTime((int64_t) blockFrames * 1000000 / mixerSampleRate);
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+        while (running) {
+            mixer.renderBlock(&output[0], blockFrames, hostMicros());
+            rendered.fetch_add(blockFrames, std::memory_order_release);
+            // Paced against the clock rather than by sleeping a block each time, so render time doesn't
+            // add up.
+            next += blockTime;
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    Mixer& mixer;
+    int blockFrames;
+    std::vector<sf::Int16> output;
+    std::atomic<bool> running;
+    std::thread thread;
+    std::atomic<uint64_t> rendered;
+};
+
+// Backends compiled into this build, the default first.
+inline std::vector<std::string> audioBackends() {
+    std::vector<std::string> names;
+    names.push_back("sfml");
+#ifdef FINGER_ALSA
+    names.push_back("alsa");
+#endif
+    names.push_back("null");
+    return names;
+}
+
+// The config a mixer playing through the named backend has to have to match what the device really does:
+// SFML always queues streamBuffers blocks, so --buffers can't change it there.
+inline MixerConfig backendConfig(const std::string& name, const MixerConfig& config) {
+    MixerConfig device = config;
+    if (name == "sfml") {
+        device.queuedBuffers = streamBuffers;
+    }
+    return device;
+}
+
+// The mixer must have been made with backendConfig(name, config).
+inline std::unique_ptr<AudioBackend> createAudioBackend(const std::string& name, Mixer& mixer,
+                                                        const MixerConfig& config) {
+    if (name == "sfml") {
+        return std::unique_ptr<AudioBackend>(new SfmlBackend(mixer, config));
+    }
+#ifdef FINGER_ALSA
+    if (name == "alsa") {
+        return std::unique_ptr<AudioBackend>(new AlsaBackend(mixer, config));
+    }
+#endif
+    if (name == "null") {
+        return std::unique_ptr<AudioBackend>(new NullBackend(mixer, config));
+    }
+    throw std::runtime_error("Audio backend " + name + " isn't available in this build");
+}
+
+struct LatencyResult {
+    int trials;
+    // Milliseconds from queuing a note to the device reporting its first frame played.
+    double mean;
+    double min;
+    double max;
+};
+
+// Plays `trials` notes through a fresh mixer on the named backend and times each from noteOn() to the
+// moment the backend says the note's first frame is at its output. That is the software part of the
+// round trip: the converter and anything analogue after it aren't included (measuring those would take a
+// loopback cable and an input). Notes are spread out by uneven gaps so they land at different points in
+// the block cycle.
+inline LatencyResult measureOutputLatency(const std::string& backendName, const NoteBank& bank,
+                                          const MixerConfig& config, int trials) {
+    MixerConfig device = backendConfig(backendName, config);
+    Mixer mixer(bank, device);
+    std::unique_ptr<AudioBackend> backend = createAudioBackend(backendName, mixer, device);
+    backend->start();
+    // Let the device settle into its steady state first.
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    LatencyResult result = { 0, 0, 0, 0 };
+    uint64_t previous = mixer.stats().lastOnset;
+    for (int i = 0; i < trials; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(40 + i * 17 % 50));
+        NoteCommand command = { 0, 0.5f, 0, 0, false };
+        int64_t issued = hostMicros();
+        mixer.noteOn(command);
+        int64_t deadline = issued + 1000000;
+        int64_t heard = 0;
+        uint64_t onset = previous;
+        while (hostMicros() < deadline) {
+            onset = mixer.stats().lastOnset;
+            if (onset != previous && backend->playedFrames() > onset) {
+                heard = hostMicros();
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        previous = onset;
+        mixer.noteOff(-1, 0);
+        if (heard == 0) {
+            continue;
+        }
+        double ms = (heard - issued) / 1000.0;
+        result.mean += ms;
+        result.min = result.trials == 0 || ms < result.min ? ms : result.min;
+        result.max = result.trials == 0 || ms > result.max ? ms : result.max;
+        result.trials++;
+    }
+    backend->stop();
+    if (result.trials > 0) {
+        result.mean /= result.trials;
+    }
+    return result;
+}
+
+// Runs measureOutputLatency() on every backend in the build and prints a comparison.
+inline void compareOutputLatency(const NoteBank& bank, const MixerConfig& config, std::ostream& out) {
+    static const int trials = 20;
+    std::vector<std::string> names = audioBackends();
+    out << "Output latency over " << trials << " notes, " << config.blockFrames << " frames per block:"
+        << std::endl;
+    for (size_t i = 0; i < names.size(); i++) {
+        out << "  " << names[i] << " (" << backendConfig(names[i], config).queuedBuffers << " buffers): ";
+        try {
+            LatencyResult r = measureOutputLatency(names[i], bank, config, trials);
+            if (r.trials == 0) {
+                out << "no output position reported" << std::endl;
+                continue;
+            }
+            out << "mean " << r.mean << " ms, min " << r.min << " ms, max " << r.max << " ms";
+            if (r.trials < trials) {
+                out << " (" << trials - r.trials << " notes never reported)";
+            }
+            out << std::endl;
+        } catch (const std::exception& e) {
+            out << e.what() << std::endl;
+        }
+    }
+}
+
+#endif
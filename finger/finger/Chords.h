@@ -0,0 +1,94 @@
+#ifndef FINGER_CHORDS_H
+#define FINGER_CHORDS_H
+
+#include <stdint.h>
+
+// The note samples, lowest first: two octaves of the natural scale. Note index i plays noteFiles[i].
+const int noteCount = 14;
+const char* const noteFiles[noteCount] = {
+    "1A.wav", "1B.wav", "1C.wav", "1D.wav", "1E.wav", "1F.wav", "1G.wav",
+    "2A.wav", "2B.wav", "2C.wav", "2D.wav", "2E.wav", "2F.wav", "2G.wav",
+};
+
+// Scale steps per octave.
+const int octaveSteps = 7;
+
+// Root note for a palm distance: one note every 4 units, starting at 4. Returns -1 outside the neck.
+inline int noteForDistance(int distance) {
+    int n = distance / 4;
+    return n >= 1 && n <= noteCount ? n - 1 : -1;
+}
+
+const int maxChordNotes = 6;
+
+// Chord shape in scale steps above the root. Because the samples are a natural scale, stacking steps
+// gives diatonic chords: a triad on A is A minor, on C is C major, and so on.
+struct Voicing {
+    const char* name;
+    int count;
+    int steps[maxChordNotes];
+};
+
+// Maps the fret hand's extended fingers to a voicing through a table indexed by the extension bitmask, so
+// recognising a chord on a strum is a single lookup.
+//
+//   fingers (index..pinky)   0: single note   1: power chord   2: triad   3: triad + octave   4: seventh
+//   thumb extended           suspends the chord: the third becomes a fourth
+class ChordRecognizer {
+public:
+    ChordRecognizer() {
+        static const Voicing shapes[5] = {
+            { "single", 1, { 0 } },
+            { "power", 2, { 0, 4 } },
+            { "triad", 3, { 0, 2, 4 } },
+            { "octave", 4, { 0, 2, 4, 7 } },
+            { "seventh", 4, { 0, 2, 4, 6 } },
+        };
+        for (int mask = 0; mask < 32; mask++) {
+            int fingers = 0;
+            for (int f = 1; f < 5; f++) {
+                if (mask & (1 << f)) {
+                    fingers++;
+                }
+            }
+            table[mask] = shapes[fingers];
+            if ((mask & 1) && fingers >= 2) {
+                table[mask].name = "sus4";
+                table[mask].steps[1] = 3;
+            }
+        }
+    }
+
+    const Voicing& voicing(uint8_t extended) const {
+        return table[extended & 31];
+    }
+
+    // Fills notes with the chord on root for the given finger configuration and returns how many there are.
+    // Notes above the neck are folded down an octave; duplicates are dropped.
+    int chord(int root, uint8_t extended, int* notes) const {
+        if (root < 0 || root >= noteCount) {
+            return 0;
+        }
+        const Voicing& v = voicing(extended);
+        int count = 0;
+        for (int i = 0; i < v.count; i++) {
+            int note = root + v.steps[i];
+            while (note >= noteCount) {
+                note -= octaveSteps;
+            }
+            bool duplicate = false;
+            for (int j = 0; j < count; j++) {
+                duplicate = duplicate || notes[j] == note;
+            }
+            if (!duplicate) {
+                notes[count++] = note;
+            }
+        }
+        return count;
+    }
+
+private:
+    Voicing table[32];
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef FINGER_CLOCK_H
+#define FINGER_CLOCK_H
+
+#include <stdint.h>
+#include <chrono>
+
+// Host time in microseconds on the monotonic clock. Every stream gets mapped onto this timeline.
+inline int64_t hostMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Maps a device clock (Myo event timestamps, Leap Frame::timestamp()) onto host time.
+//
+// Each observation is a device timestamp paired with the host time it arrived at. Delivery delay only ever
+// makes the host time later, so the lower envelope of (host - device) is the clock offset plus the minimum
+// latency. We keep the minimum per one-second bucket and fit a line through the last few buckets, which
+// gives the offset and the drift between the two oscillators without being thrown by delivery jitter.
+class ClockMapper {
+public:
+    static const int buckets = 16;
+    static const int64_t bucketMicros = 1000000;
+
+    ClockMapper()
+    : count(0), current(0), offset(0), drift(0), origin(0), lastMapped(0), started(false), fitted(false)
+    {
+    }
+
+    void observe(int64_t device, int64_t host) {
+        int64_t d = host - device;
+        if (!started) {
+            started = true;
+            origin = device;
+            offset = d;
+            startBucket(device, d);
+            return;
+        }
+        Bucket& b = history[current];
+        if (device - b.start >= bucketMicros) {
+            fit();
+            current = (current + 1) % buckets;
+            startBucket(device, d);
+        } else if (d < b.minDelta) {
+            b.minDelta = d;
+            b.device = device;
+        }
+        // Until a fit has produced a line, follow the running minimum.
+        if (!fitted && d < offset) {
+            offset = d;
+        }
+    }
+
+    bool ready() const {
+        return started;
+    }
+
+    // Host time for a device timestamp. Results never go backwards, so consumers see one monotonic timeline.
+    int64_t map(int64_t device) {
+        int64_t host = device + offset + (int64_t) (drift * (double) (device - origin));
+        if (host < lastMapped) {
+            host = lastMapped;
+        }
+        lastMapped = host;
+        return host;
+    }
+
+    // Inverse of map(): the device time at which the device clock reads host time `host`.
+    int64_t toDevice(int64_t host) const {
+        return origin + (int64_t) ((double) (host - offset - origin) / (1.0 + drift));
+    }
+
+    // Rate difference between the device and host clocks, in parts per million.
+    double driftPpm() const {
+        return drift * 1e6;
+    }
+
+private:
+    struct Bucket {
+        int64_t start;
+        int64_t device;
+        int64_t minDelta;
+    };
+
+    void startBucket(int64_t device, int64_t d) {
+        Bucket& b = history[current];
+        b.start = device;
+        b.device = device;
+        b.minDelta = d;
+        if (count < buckets) {
+            count++;
+        }
+    }
+
+    // Least-squares line through the bucket minima, relative to origin to keep the sums well conditioned.
+    void fit() {
+        if (count < 2) {
+            return;
+        }
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        for (int i = 0; i < count; i++) {
+            double x = (double) (history[i].device - origin);
+            double y = (double) history[i].minDelta;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        double n = count;
+        double denom = n * sxx - sx * sx;
+        if (denom <= 0) {
+            return;
+        }
+        drift = (n * sxy - sx * sy) / denom;
+        offset = (int64_t) ((sy - drift * sx) / n);
+        fitted = true;
+    }
+
+    Bucket history[buckets];
+    int count;
+    int current;
+    int64_t offset;
+    double drift;
+    int64_t origin;
+    int64_t lastMapped;
+    bool started;
+    bool fitted;
+};
+
+#endif
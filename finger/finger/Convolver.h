@@ -0,0 +1,245 @@
+#ifndef FINGER_CONVOLVER_H
+#define FINGER_CONVOLVER_H
+
+#include <stddef.h>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "Fft.h"
+#include "Simd.h"
+
+// Convolves a stereo stream with a mono impulse response by uniformly partitioned overlap-save: the IR is
+// cut into partitions of `partition` frames, each transformed once at load time, and every `partition`
+// frames of input the newest input spectrum is multiplied against all of them (against a delay line of the
+// older input spectra) and transformed back. Output lags input by one partition, plus an optional delay
+// given at load time; whole partitions of that delay cost nothing.
+//
+// Both channels go through one complex FFT, left in the real part and right in the imaginary part. The IR
+// is real, so the two convolutions come back out in the same parts without mixing.
+//
+// Everything is sized in load(); process() doesn't allocate, and its cost per partition is fixed by the
+// IR length.
+class PartitionedConvolver {
+public:
+    PartitionedConvolver()
+    : partition(0), count(0), lead(0), slot(0), filled(0)
+    {
+    }
+
+    // partitionFrames must be a power of two of at least 2. The IR is delayed by delayFrames.
+    void load(const float* ir, size_t length, int partitionFrames, size_t delayFrames = 0) {
+        if (length == 0) {
+            throw std::runtime_error("Empty impulse response");
+        }
+        partition = partitionFrames;
+        fft = Fft(2 * partition);
+        int n = 2 * partition;
+        // Leading partitions that would be all zeros only need their place in the input history.
+        lead = (int) (delayFrames / partition);
+        size_t pad = delayFrames % partition;
+        count = lead + (int) ((pad + length + partition - 1) / partition);
+        irRe.assign((size_t) (count - lead) * n, 0);
+        irIm.assign((size_t) (count - lead) * n, 0);
+        for (size_t i = 0; i < length; i++) {
+            size_t at = pad + i;
+            irRe[at / partition * n + at % partition] = ir[i];
+        }
+        for (int k = 0; k < count - lead; k++) {
+            fft.forward(&irRe[(size_t) k * n], &irIm[(size_t) k * n]);
+        }
+        historyRe.assign((size_t) count * n, 0);
+        historyIm.assign((size_t) count * n, 0);
+        inputRe.assign(n, 0);
+        inputIm.assign(n, 0);
+        sumRe.assign(n, 0);
+        sumIm.assign(n, 0);
+        outputRe.assign(partition, 0);
+        outputIm.assign(partition, 0);
+        reset();
+    }
+
+    bool loaded() const {
+        return count > 0;
+    }
+
+    // Frames the output lags the input by, not counting the load-time delay.
+    int latency() const {
+        return partition;
+    }
+
+    // Clears the stream, as if it had been silent for as long as the IR.
+    void reset() {
+        std::fill(historyRe.begin(), historyRe.end(), 0.0f);
+        std::fill(historyIm.begin(), historyIm.end(), 0.0f);
+        std::fill(inputRe.begin(), inputRe.end(), 0.0f);
+        std::fill(inputIm.begin(), inputIm.end(), 0.0f);
+        std::fill(outputRe.begin(), outputRe.end(), 0.0f);
+        std::fill(outputIm.begin(), outputIm.end(), 0.0f);
+        slot = 0;
+        filled = 0;
+    }
+
+    // Adds the convolution of interleaved stereo `in` into `out`.
+    void process(const float* in, float* out, int frames) {
+        for (int i = 0; i < frames; i++) {
+            inputRe[partition + filled] = in[2 * i];
+            inputIm[partition + filled] = in[2 * i + 1];
+            out[2 * i] += outputRe[filled];
+            out[2 * i + 1] += outputIm[filled];
+            if (++filled == partition) {
+                convolve();
+                filled = 0;
+            }
+        }
+    }
+
+private:
+    void convolve() {
+        int n = 2 * partition;
+        // Overlap-save: transform the last two partitions of input, newest into the history slot.
+        float* xr = &historyRe[(size_t) slot * n];
+        float* xi = &historyIm[(size_t) slot * n];
+        std::copy(inputRe.begin(), inputRe.end(), xr);
+        std::copy(inputIm.begin(), inputIm.end(), xi);
+        fft.forward(xr, xi);
+        std::copy(inputRe.begin() + partition, inputRe.end(), inputRe.begin());
+        std::copy(inputIm.begin() + partition, inputIm.end(), inputIm.begin());
+
+        // Partition k of the IR meets the input from k partitions ago.
+        std::fill(sumRe.begin(), sumRe.end(), 0.0f);
+        std::fill(sumIm.begin(), sumIm.end(), 0.0f);
+        for (int k = lead; k < count; k++) {
+            int s = slot - k < 0 ? slot - k + count : slot - k;
+            multiplyAdd(&historyRe[(size_t) s * n], &historyIm[(size_t) s * n], &irRe[(size_t) (k - lead) * n],
+                        &irIm[(size_t) (k - lead) * n], n);
+        }
+        slot = slot + 1 == count ? 0 : slot + 1;
+
+        // The first half wraps around circularly; the second half is the new output.
+        fft.inverse(&sumRe[0], &sumIm[0]);
+        std::copy(sumRe.begin() + partition, sumRe.end(), outputRe.begin());
+        std::copy(sumIm.begin() + partition, sumIm.end(), outputIm.begin());
+    }
+
+    // sum += x * h, complex, over n bins.
+    void multiplyAdd(const float* xr, const float* xi, const float* hr, const float* hi, int n) {
+        float* sr = &sumRe[0];
+        float* si = &sumIm[0];
+        int i = 0;
+#ifdef FINGER_SSE
+        for (; i + 4 <= n; i += 4) {
+            __m128 ar = _mm_loadu_ps(xr + i);
+            __m128 ai = _mm_loadu_ps(xi + i);
+            __m128 br = _mm_loadu_ps(hr + i);
+            __m128 bi = _mm_loadu_ps(hi + i);
+            __m128 re = _mm_sub_ps(_mm_mul_ps(ar, br), _mm_mul_ps(ai, bi));
+            __m128 im = _mm_add_ps(_mm_mul_ps(ar, bi), _mm_mul_ps(ai, br));
+            _mm_storeu_ps(sr + i, _mm_add_ps(_mm_loadu_ps(sr + i), re));
+            _mm_storeu_ps(si + i, _mm_add_ps(_mm_loadu_ps(si + i), im));
+        }
+#endif
+        for (; i < n; i++) {
+            sr[i] += xr[i] * hr[i] - xi[i] * hi[i];
+            si[i] += xr[i] * hi[i] + xi[i] * hr[i];
+        }
+    }
+
+    int partition;
+    // Partitions in the delayed IR, the first `lead` of which are all zeros.
+    int count;
+    int lead;
+    Fft fft;
+    // Spectra of the IR's non-zero partitions, then of the last `count` partitions of input, the newest at
+    // `slot`.
+    std::vector<float> irRe, irIm;
+    std::vector<float> historyRe, historyIm;
+    int slot;
+    // Previous partition of input followed by the one being collected, `filled` frames of it so far.
+    std::vector<float> inputRe, inputIm;
+    int filled;
+    std::vector<float> sumRe, sumIm;
+    std::vector<float> outputRe, outputIm;
+};
+
+// Convolution engine for impulse responses from a few milliseconds (a cabinet) to several seconds (a body or
+// a room), at the latency of a small partition. The head of the IR goes through partitions of
+// `headPartition` frames; further along the partitions double in size, a few of each size, up to
+// `maxPartition`. A tail short enough to take only a few more partitions stays at the size it is at. Each
+// size is a PartitionedConvolver, delayed so its part of the IR lines up with the head. Later parts of the
+// IR are in no hurry, so they get long FFTs, which cost far less per frame than hundreds of short ones
+// would.
+//
+// With maxPartition equal to headPartition this is plain uniform partitioning. A larger maxPartition is
+// cheaper on average, but the blocks in which a big partition falls due do that partition's whole FFT, so
+// it also sets the worst case per block.
+class Convolver {
+public:
+    // Partitions of each size before moving up to the next one.
+    static const int partitionsPerSize = 16;
+
+    Convolver()
+    : head(0)
+    {
+    }
+
+    // Both sizes must be powers of two, maxPartition no smaller than headPartition. Everything the
+    // convolution needs is allocated here.
+    void load(const float* ir, size_t length, int headPartition, int maxPartition) {
+        if (maxPartition < headPartition) {
+            throw std::runtime_error("Largest convolution partition is smaller than the first");
+        }
+        head = headPartition;
+        segments.clear();
+        size_t offset = 0;
+        for (int partition = headPartition; offset < length; partition *= 2) {
+            size_t span = (size_t) partitionsPerSize * partition;
+            if (partition * 2 > maxPartition || length - offset <= 2 * span) {
+                span = length - offset;
+            }
+            segments.push_back(PartitionedConvolver());
+            // A segment's own latency is its partition, so it is delayed by the rest of the offset its part
+            // of the IR starts at. The first segments and the head always leave that non-negative.
+            segments.back().load(ir + offset, span, partition, offset + headPartition - partition);
+            offset += span;
+        }
+        dry.assign(2 * chunkFrames, 0);
+    }
+
+    bool loaded() const {
+        return !segments.empty();
+    }
+
+    int latency() const {
+        return head;
+    }
+
+    void reset() {
+        for (size_t i = 0; i < segments.size(); i++) {
+            segments[i].reset();
+        }
+    }
+
+    // Replaces interleaved stereo frames with their convolution.
+    void process(float* stereo, int frames) {
+        while (frames > 0) {
+            int n = frames < chunkFrames ? frames : chunkFrames;
+            std::copy(stereo, stereo + 2 * n, dry.begin());
+            std::fill(stereo, stereo + 2 * n, 0.0f);
+            for (size_t i = 0; i < segments.size(); i++) {
+                segments[i].process(&dry[0], stereo, n);
+            }
+            stereo += 2 * n;
+            frames -= n;
+        }
+    }
+
+private:
+    // Frames of input copied aside at a time.
+    static const int chunkFrames = 256;
+
+    int head;
+    std::vector<PartitionedConvolver> segments;
+    std::vector<float> dry;
+};
+
+#endif
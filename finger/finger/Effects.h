@@ -0,0 +1,440 @@
+#ifndef FINGER_EFFECTS_H
+#define FINGER_EFFECTS_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <SFML/Audio.hpp>
+#include "Convolver.h"
+#include "NoteBank.h"
+#include "Simd.h"
+
+static_assert(mixerChannels == 2, "The effects work on interleaved stereo");
+
+// First and largest partition sizes for the cabinet convolution. The cabinet delays the signal by the
+// first; the largest bounds the work in any one block for a long IR.
+const int cabinetPartition = 64;
+const int cabinetMaxPartition = 2048;
+
+// Which effects run on the mix. A stage that isn't configured costs nothing at all.
+struct EffectsConfig {
+    // Overdrive, and its gain into the waveshaper in dB.
+    bool overdrive;
+    float drive;
+    // Cabinet (or guitar body, or room) impulse response at mixerSampleRate, up to several seconds long;
+    // no cabinet if empty.
+    std::vector<float> cabinet;
+    // Reverb level (0 is no reverb, 1 all reverb), seconds for it to die away by 60 dB, and how much of the
+    // top end each trip round the loop loses (0-1).
+    float reverb;
+    float reverbTime;
+    float damping;
+
+    EffectsConfig()
+    : overdrive(false), drive(18), reverb(0), reverbTime(1.8f), damping(0.3f)
+    {
+    }
+};
+
+enum EffectStage { effectOverdrive, effectCabinet, effectReverb, effectStages };
+
+// Reads an impulse response from a WAV file at mixerSampleRate, averaging its channels.
+inline void loadImpulse(const std::string& path, std::vector<float>& ir) {
+    sf::InputSoundFile file;
+    if (!file.openFromFile(path)) {
+        throw std::runtime_error("Unable to read impulse response " + path);
+    }
+    if (file.getSampleRate() != mixerSampleRate) {
+        throw std::runtime_error("Impulse response " + path + " is not at the mixer's sample rate");
+    }
+    unsigned int channels = file.getChannelCount();
+    std::vector<sf::Int16> samples((size_t) file.getSampleCount());
+    samples.resize((size_t) file.read(samples.empty() ? 0 : &samples[0], samples.size()));
+    ir.assign(samples.size() / channels, 0);
+    for (size_t i = 0; i < ir.size(); i++) {
+        for (unsigned int c = 0; c < channels; c++) {
+            ir[i] += samples[i * channels + c] / (32768.0f * channels);
+        }
+    }
+    if (ir.empty()) {
+        throw std::runtime_error("Impulse response " + path + " is empty");
+    }
+}
+
+// Waveshaping overdrive, run at twice the sample rate so the harmonics it adds above Nyquist are mostly
+// filtered out instead of folding back down as aliasing. Up- and downsampling share a 23-tap halfband
+// filter; between them they delay the signal by 11 frames.
+class Overdrive {
+public:
+    // Non-zero taps either side of the halfband filter's centre; every other tap is zero.
+    static const int taps = 12;
+
+    Overdrive()
+    : gain(1)
+    {
+    }
+
+    void init(float driveDb, int maxFrames) {
+        gain = std::pow(10.0f, driveDb / 20);
+        // Windowed sinc at half the band; only the odd offsets -11, -9, ..., 11 are non-zero.
+        double h[taps];
+        double sum = 0;
+        for (int k = 0; k < taps; k++) {
+            int d = 2 * k - (taps - 1);
+            double x = M_PI * d / 2;
+            double window = 0.42 + 0.5 * std::cos(M_PI * d / taps) + 0.08 * std::cos(2 * M_PI * d / taps);
+            h[k] = 0.5 * std::sin(x) / x * window;
+            sum += h[k];
+        }
+        // The centre tap is 1/2, and the filter passes DC unchanged.
+        for (int k = 0; k < taps; k++) {
+            down[k] = (float) (h[k] * 0.5 / sum);
+            up[k] = 2 * down[k];
+        }
+        for (int c = 0; c < 2; c++) {
+            input[c].assign(taps + maxFrames, 0);
+            even[c].assign(taps + maxFrames, 0);
+            odd[c].assign(taps + maxFrames, 0);
+        }
+        scratch.assign(maxFrames, 0);
+    }
+
+    void reset() {
+        for (int c = 0; c < 2; c++) {
+            std::fill(input[c].begin(), input[c].end(), 0.0f);
+            std::fill(even[c].begin(), even[c].end(), 0.0f);
+            std::fill(odd[c].begin(), odd[c].end(), 0.0f);
+        }
+    }
+
+    // At most the maxFrames given to init().
+    void process(float* stereo, int frames) {
+        for (int c = 0; c < 2; c++) {
+            float* x = &input[c][0];
+            float* e = &even[c][0];
+            float* o = &odd[c][0];
+            for (int i = 0; i < frames; i++) {
+                x[taps + i] = stereo[2 * i + c] * gain;
+            }
+            // Each input frame becomes two: the even one is the input itself (the other even taps are
+            // zero), the odd one is interpolated.
+            for (int i = 0; i < frames; i++) {
+                e[taps + i] = x[taps + i - taps / 2];
+            }
+            fir(up, x + 1, o + taps, frames);
+            shape(e + taps, frames);
+            shape(o + taps, frames);
+            // Filter again and keep every other frame.
+            fir(down, o + 1, &scratch[0], frames);
+            for (int i = 0; i < frames; i++) {
+                stereo[2 * i + c] = outputLevel * (0.5f * e[taps + i - (taps / 2 - 1)] + scratch[i]);
+            }
+            std::copy(x + frames, x + frames + taps, x);
+            std::copy(e + frames, e + frames + taps, e);
+            std::copy(o + frames, o + frames + taps, o);
+        }
+    }
+
+private:
+    // Fully driven output peaks at +-1; bring it back to about where a clean note peaks.
+    static constexpr float outputLevel = 0.5f;
+
+    // out[i] = sum of c[k] * x[i + k].
+    static void fir(const float* c, const float* x, float* out, int frames) {
+        int i = 0;
+#ifdef FINGER_SSE
+        for (; i + 4 <= frames; i += 4) {
+            __m128 sum = _mm_setzero_ps();
+            for (int k = 0; k < taps; k++) {
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(c[k]), _mm_loadu_ps(x + i + k)));
+            }
+            _mm_storeu_ps(out + i, sum);
+        }
+#endif
+        for (; i < frames; i++) {
+            float sum = 0;
+            for (int k = 0; k < taps; k++) {
+                sum += c[k] * x[i + k];
+            }
+            out[i] = sum;
+        }
+    }
+
+    // x (27 + x^2) / (27 + 9 x^2), a close match to tanh that reaches +-1 with zero slope at +-3.
+    static void shape(float* x, int frames) {
+        int i = 0;
+#ifdef FINGER_SSE
+        const __m128 low = _mm_set1_ps(-3), high = _mm_set1_ps(3);
+        const __m128 k27 = _mm_set1_ps(27), k9 = _mm_set1_ps(9);
+        for (; i + 4 <= frames; i += 4) {
+            __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(x + i), low), high);
+            __m128 v2 = _mm_mul_ps(v, v);
+            __m128 num = _mm_mul_ps(v, _mm_add_ps(k27, v2));
+            _mm_storeu_ps(x + i, _mm_div_ps(num, _mm_add_ps(k27, _mm_mul_ps(k9, v2))));
+        }
+#endif
+        for (; i < frames; i++) {
+            float v = x[i] < -3 ? -3 : x[i] > 3 ? 3 : x[i];
+            float v2 = v * v;
+            x[i] = v * (27 + v2) / (27 + 9 * v2);
+        }
+    }
+
+    float gain;
+    float up[taps];
+    float down[taps];
+    // Per channel, the last `taps` frames of the previous block followed by this one: the scaled input and
+    // the shaped even and odd frames at twice the rate.
+    std::vector<float> input[2];
+    std::vector<float> even[2];
+    std::vector<float> odd[2];
+    std::vector<float> scratch;
+};
+
+// Feedback delay network reverb: eight delay lines of unrelated lengths, each damped by a one-pole
+// lowpass and fed back through a Hadamard matrix, which mixes every line into every other without
+// gaining or losing energy. The feedback gain per line sets the decay time. The cost per frame is fixed.
+class Reverb {
+public:
+    static const int lines = 8;
+    // Power of two above the longest line.
+    static const int lineFrames = 2048;
+
+    Reverb()
+    : wet(0), damping(0), write(0)
+    {
+    }
+
+    void init(float level, float seconds, float damp) {
+        // Freeverb's comb lengths at 44.1 kHz.
+        static const int lengths[lines] = { 1116, 1188, 1277, 1356, 1422, 1491, 1557, 1617 };
+        wet = level;
+        damping = damp;
+        for (int j = 0; j < lines; j++) {
+            length[j] = lengths[j];
+            // Down 60 dB after `seconds`, taken in trips of this line's length.
+            feedback[j] = std::pow(10.0f, -3.0f * lengths[j] / (seconds * mixerSampleRate));
+        }
+        delay.assign(lines * lineFrames, 0);
+        reset();
+    }
+
+    void reset() {
+        std::fill(delay.begin(), delay.end(), 0.0f);
+        for (int j = 0; j < lines; j++) {
+            state[j] = 0;
+        }
+        write = 0;
+    }
+
+    void process(float* stereo, int frames) {
+        const float scale = 0.35355339f;  // 1/sqrt(8) keeps the Hadamard matrix lossless
+        for (int i = 0; i < frames; i++) {
+            float in = 0.25f * (stereo[2 * i] + stereo[2 * i + 1]);
+            float out[lines];
+            float m[lines];
+            for (int j = 0; j < lines; j++) {
+                out[j] = delay[j * lineFrames + ((write - length[j]) & (lineFrames - 1))];
+                state[j] = out[j] + damping * (state[j] - out[j]);
+                m[j] = state[j] * feedback[j];
+            }
+            for (int span = 1; span < lines; span *= 2) {
+                for (int j = 0; j < lines; j += 2 * span) {
+                    for (int k = j; k < j + span; k++) {
+                        float a = m[k];
+                        float b = m[k + span];
+                        m[k] = a + b;
+                        m[k + span] = a - b;
+                    }
+                }
+            }
+            for (int j = 0; j < lines; j++) {
+                delay[j * lineFrames + write] = in + m[j] * scale;
+            }
+            write = (write + 1) & (lineFrames - 1);
+
+            float left = 0.25f * (out[0] + out[2] + out[4] + out[6]);
+            float right = 0.25f * (out[1] + out[3] + out[5] + out[7]);
+            stereo[2 * i] += wet * (left - stereo[2 * i]);
+            stereo[2 * i + 1] += wet * (right - stereo[2 * i + 1]);
+        }
+    }
+
+private:
+    float wet;
+    float damping;
+    int length[lines];
+    float feedback[lines];
+    float state[lines];
+    std::vector<float> delay;
+    int write;
+};
+
+// Overdrive into cabinet into reverb, run on the mix bus in place. Everything is allocated up front for
+// blocks of up to maxFrames.
+class EffectsChain {
+public:
+    EffectsChain(const EffectsConfig& config, int maxFrames) {
+        present[effectOverdrive] = config.overdrive;
+        present[effectCabinet] = !config.cabinet.empty();
+        present[effectReverb] = config.reverb > 0;
+        if (present[effectOverdrive]) {
+            overdrive.init(config.drive, maxFrames);
+        }
+        if (present[effectCabinet]) {
+            // Normalised to unit energy, so a cabinet colours the sound without making it much louder or
+            // quieter.
+            std::vector<float> ir(config.cabinet);
+            double energy = 0;
+            for (size_t i = 0; i < ir.size(); i++) {
+                energy += (double) ir[i] * ir[i];
+            }
+            float scale = energy > 0 ? (float) (1 / std::sqrt(energy)) : 0;
+            for (size_t i = 0; i < ir.size(); i++) {
+                ir[i] *= scale;
+            }
+            cabinet.load(&ir[0], ir.size(), cabinetPartition, cabinetMaxPartition);
+        }
+        if (present[effectReverb]) {
+            reverb.init(config.reverb, config.reverbTime, config.damping);
+        }
+        for (int s = 0; s < effectStages; s++) {
+            bypassed[s].store(false);
+            skipped[s] = false;
+        }
+    }
+
+    // Any thread: stop running a stage from the next block, or start it again (from silence).
+    void bypass(EffectStage stage, bool off) {
+        bypassed[stage].store(off, std::memory_order_relaxed);
+    }
+
+    // At most maxFrames of interleaved stereo.
+    void process(float* stereo, int frames) {
+        if (running(effectOverdrive)) {
+            overdrive.process(stereo, frames);
+        }
+        if (running(effectCabinet)) {
+            cabinet.process(stereo, frames);
+        }
+        if (running(effectReverb)) {
+            reverb.process(stereo, frames);
+        }
+    }
+
+private:
+    EffectsChain(const EffectsChain&);
+    EffectsChain& operator=(const EffectsChain&);
+
+    bool running(EffectStage stage) {
+        if (!present[stage]) {
+            return false;
+        }
+        bool off = bypassed[stage].load(std::memory_order_relaxed);
+        if (!off && skipped[stage]) {
+            // Whatever it held from before the bypass would come out as a glitch.
+            if (stage == effectOverdrive) {
+                overdrive.reset();
+            } else if (stage == effectCabinet) {
+                cabinet.reset();
+            } else {
+                reverb.reset();
+            }
+        }
+        skipped[stage] = off;
+        return !off;
+    }
+
+    bool present[effectStages];
+    std::atomic<bool> bypassed[effectStages];
+    bool skipped[effectStages];
+    Overdrive overdrive;
+    Convolver cabinet;
+    Reverb reverb;
+};
+
+// Decaying noise, a stand-in for an impulse response.
+inline void syntheticImpulse(std::vector<float>& ir, size_t frames, float decayFrames) {
+    uint32_t seed = 1;
+    ir.resize(frames);
+    for (size_t i = 0; i < frames; i++) {
+        seed = seed * 1664525 + 1013904223;
+        ir[i] = ((seed >> 8) / 8388608.0f - 1) * std::exp(-(float) i / decayFrames);
+    }
+}
+
+// Times `process` over `blocks` blocks of `frames` frames of decaying noise bursts, in microseconds per block.
+template <typename Process>
+void timeBlocks(Process& process, int frames, int blocks, double& mean, double& worst) {
+    std::vector<float> block(frames * 2);
+    uint32_t seed = 1;
+    double total = 0;
+    worst = 0;
+    for (int b = 0; b < blocks; b++) {
+        // A new burst every half second, like a strum.
+        for (int i = 0; i < frames; i++) {
+            int t = (b * frames + i) % (mixerSampleRate / 2);
+            seed = seed * 1664525 + 1013904223;
+            float sample = ((seed >> 8) / 8388608.0f - 1) * 0.5f * std::exp(-t / 8000.0f);
+            block[2 * i] = sample;
+            block[2 * i + 1] = sample;
+        }
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        process.process(&block[0], frames);
+        double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now()
+                                                                  - started).count();
+        total += micros;
+        worst = std::max(worst, micros);
+    }
+    mean = total / blocks;
+}
+
+// Times each configured stage on its own, all of them bypassed, and the whole chain over 256-frame blocks,
+// and prints the mean and worst block against the time a block lasts. Stages that aren't configured are
+// benchmarked with their defaults (and a 2048-frame synthetic cabinet). Then does the same for a 3 s IR
+// through the convolution engine, uniformly and non-uniformly partitioned.
+inline void benchmarkEffects(EffectsConfig config, std::ostream& out) {
+    const int frames = 256;
+    const int blocks = 4000;
+    const double budgetMicros = frames * 1e6 / mixerSampleRate;
+    double mean, worst;
+
+    config.overdrive = true;
+    if (config.cabinet.empty()) {
+        syntheticImpulse(config.cabinet, 2048, 300);
+    }
+    if (config.reverb <= 0) {
+        config.reverb = 0.3f;
+    }
+
+    const char* names[] = { "bypassed", "overdrive", "cabinet", "reverb", "chain" };
+    for (int run = 0; run < 5; run++) {
+        EffectsChain chain(config, frames);
+        for (int s = 0; s < effectStages; s++) {
+            // Runs 1-3 are one stage each, run 4 all of them.
+            chain.bypass((EffectStage) s, run != 4 && run != s + 1);
+        }
+        timeBlocks(chain, frames, blocks, mean, worst);
+        out << names[run] << ": mean " << mean << " us, worst " << worst << " us per " << frames
+            << "-frame block (" << 100 * mean / budgetMicros << "% of the block)" << std::endl;
+    }
+
+    std::vector<float> ir;
+    syntheticImpulse(ir, 3 * mixerSampleRate, mixerSampleRate / 4);
+    for (int run = 0; run < 2; run++) {
+        Convolver convolver;
+        convolver.load(&ir[0], ir.size(), cabinetPartition, run == 0 ? cabinetPartition : cabinetMaxPartition);
+        timeBlocks(convolver, frames, blocks / 4, mean, worst);
+        out << "3 s IR, " << (run == 0 ? "uniform" : "non-uniform") << ": mean " << mean << " us, worst "
+            << worst << " us per " << frames << "-frame block (" << 100 * mean / budgetMicros
+            << "% of the block)" << std::endl;
+    }
+}
+
+#endif
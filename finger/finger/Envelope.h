@@ -0,0 +1,247 @@
+#ifndef FINGER_ENVELOPE_H
+#define FINGER_ENVELOPE_H
+
+#include <stdint.h>
+#include <cmath>
+#include "Simd.h"
+
+// Envelope shape: times in seconds, sustain as a fraction of full level. Exponential segments curve like an
+// analogue envelope; linear ones are straight ramps.
+struct Adsr {
+    float attack;
+    float decay;
+    float sustain;
+    float release;
+    bool exponential;
+
+    Adsr()
+    : attack(0.002f), decay(0.3f), sustain(0.6f), release(0.15f), exponential(true)
+    {
+    }
+};
+
+// Frames between envelope evaluations. Voices interpolate linearly in between, so this only limits how
+// sharp a corner can be, not how smooth the gain is.
+const int envelopeStep = 32;
+
+// ADSR envelopes for N voices, advanced envelopeStep frames at a time for all of them at once.
+//
+// Every segment is one multiply-add followed by a clamp, next = clamp(next * mul + add, lo, hi): linear
+// segments have mul = 1, exponential ones aim past their end level (so they reach it in finite time) and
+// are clamped there. That makes a step the same few SIMD instructions for every voice whatever stage each
+// is in, and a segment is over exactly when its clamp bound is hit.
+template <int N>
+class EnvelopeBank {
+public:
+    static_assert(N % 4 == 0 && N <= 32, "EnvelopeBank works on groups of four voices, at most 32");
+
+    enum Stage { resting, attacking, decaying, sustaining, releasing };
+
+    explicit EnvelopeBank(float sampleRate, const Adsr& shape = Adsr())
+    : rate(sampleRate)
+    {
+        setShape(shape);
+        for (int v = 0; v < N; v++) {
+            stage[v] = resting;
+            level[v] = 0;
+            next[v] = 0;
+            hold(v);
+        }
+    }
+
+    void setShape(const Adsr& s) {
+        shape = s;
+        attackMul = segmentMul(s.attack, attackOvershoot);
+        attackAdd = segmentAdd(s.attack, 0, 1, attackOvershoot, attackMul);
+        decayMul = segmentMul(s.decay, decayOvershoot);
+        decayAdd = segmentAdd(s.decay, 1, s.sustain, decayOvershoot, decayMul);
+        releaseMul = segmentMul(s.release, releaseOvershoot);
+    }
+
+    const Adsr& getShape() const {
+        return shape;
+    }
+
+    // Start voice v from silence. Its first step is taken straight away, so a voice starting partway through
+    // a step is already rising by the time the step ends.
+    void start(int v) {
+        level[v] = 0;
+        next[v] = 0;
+        enter(v, attacking);
+        next[v] = clamp(next[v] * mul[v] + add[v], lo[v], hi[v]);
+    }
+
+    // Move voice v to its release from wherever it is now.
+    void release(int v) {
+        if (stage[v] != resting && stage[v] != releasing) {
+            enter(v, releasing);
+        }
+    }
+
+    // Gain change per frame over the current step.
+    float slope(int v) const {
+        return (next[v] - level[v]) * (1.0f / envelopeStep);
+    }
+
+    // Silence voice v at once, e.g. because its sample ran out.
+    void stop(int v) {
+        enter(v, resting);
+    }
+
+    bool active(int v) const {
+        return stage[v] != resting;
+    }
+
+    // How loud voice v counts as when choosing one to steal: its level at the end of the step, except in
+    // the attack, where it counts as already at the peak it is rising to. Otherwise the newest note would
+    // always look the quietest.
+    float loudness(int v) const {
+        return stage[v] == attacking ? 1.0f : next[v];
+    }
+
+    // Advance every voice by one step. Returns a bit per voice that finished its release during it.
+    uint32_t advance() {
+        uint32_t ended = 0;
+#ifdef FINGER_SSE
+        for (int v = 0; v < N; v += 4) {
+            __m128 n = _mm_load_ps(&next[v]);
+            _mm_store_ps(&level[v], n);
+            n = _mm_add_ps(_mm_mul_ps(n, _mm_load_ps(&mul[v])), _mm_load_ps(&add[v]));
+            __m128 low = _mm_load_ps(&lo[v]);
+            __m128 high = _mm_load_ps(&hi[v]);
+            n = _mm_min_ps(_mm_max_ps(n, low), high);
+            _mm_store_ps(&next[v], n);
+            // A moving segment that has hit a bound is over.
+            __m128 done = _mm_or_ps(_mm_cmple_ps(n, low), _mm_cmpge_ps(n, high));
+            ended |= (uint32_t) _mm_movemask_ps(_mm_and_ps(done, _mm_load_ps(&moving[v]))) << v;
+        }
+#else
+        for (int v = 0; v < N; v++) {
+            level[v] = next[v];
+            next[v] = clamp(next[v] * mul[v] + add[v], lo[v], hi[v]);
+            bool ramping = stage[v] == attacking || stage[v] == decaying || stage[v] == releasing;
+            if (ramping && (next[v] <= lo[v] || next[v] >= hi[v])) {
+                ended |= 1u << v;
+            }
+        }
+#endif
+        // Only voices whose segment just ended need looking at.
+        uint32_t finished = 0;
+        while (ended) {
+            int v = lowestBit(ended);
+            ended &= ended - 1;
+            if (stage[v] == attacking) {
+                enter(v, decaying);
+            } else if (stage[v] == decaying) {
+                enter(v, sustaining);
+            } else if (stage[v] == releasing) {
+                enter(v, resting);
+                finished |= 1u << v;
+            }
+        }
+        return finished;
+    }
+
+    // Per voice, SoA and 16-byte aligned for SSE: the level at the start and end of the current step.
+    alignas(16) float level[N];
+    alignas(16) float next[N];
+
+private:
+    // How far past its end level each kind of exponential segment aims: small is more curved.
+    static constexpr float attackOvershoot = 0.3f;
+    static constexpr float decayOvershoot = 0.01f;
+    static constexpr float releaseOvershoot = 0.01f;
+
+    static float clamp(float x, float low, float high) {
+        return x < low ? low : x > high ? high : x;
+    }
+
+    static int lowestBit(uint32_t bits) {
+        int v = 0;
+        while (!(bits & (1u << v))) {
+            v++;
+        }
+        return v;
+    }
+
+    float steps(float seconds) const {
+        float n = seconds * rate / envelopeStep;
+        return n < 1 ? 1 : n;
+    }
+
+    // Multiplier for an exponential segment that covers its distance in `seconds`, aiming `overshoot` of
+    // that distance past the end.
+    float segmentMul(float seconds, float overshoot) const {
+        return shape.exponential ? std::pow(overshoot / (1 + overshoot), 1 / steps(seconds)) : 1;
+    }
+
+    // Add term for a segment from one level to another in `seconds`, given its multiplier.
+    float segmentAdd(float seconds, float from, float to, float overshoot, float mul) const {
+        if (!shape.exponential) {
+            return (to - from) / steps(seconds);
+        }
+        return (to + (to - from) * overshoot) * (1 - mul);
+    }
+
+    void hold(int v) {
+        mul[v] = 1;
+        add[v] = 0;
+        lo[v] = 0;
+        hi[v] = 1;
+        moving[v] = 0;
+    }
+
+    void enter(int v, Stage s) {
+        stage[v] = s;
+        switch (s) {
+        case attacking:
+            mul[v] = attackMul;
+            add[v] = attackAdd;
+            lo[v] = 0;
+            hi[v] = 1;
+            break;
+        case decaying:
+            mul[v] = decayMul;
+            add[v] = decayAdd;
+            lo[v] = shape.sustain;
+            hi[v] = 1;
+            break;
+        case releasing:
+            // The release starts from the current level, so its slope is worked out now.
+            mul[v] = releaseMul;
+            add[v] = shape.exponential ? -releaseOvershoot * next[v] * (1 - releaseMul)
+                                       : -next[v] / steps(shape.release);
+            lo[v] = 0;
+            hi[v] = 1;
+            break;
+        case sustaining:
+        case resting:
+            hold(v);
+            next[v] = s == resting ? 0 : shape.sustain;
+            return;
+        }
+        moving[v] = allOnes();
+    }
+
+    static float allOnes() {
+        union { uint32_t u; float f; } bits;
+        bits.u = 0xffffffffu;
+        return bits.f;
+    }
+
+    float rate;
+    Adsr shape;
+    float attackMul, attackAdd;
+    float decayMul, decayAdd;
+    float releaseMul;
+
+    Stage stage[N];
+    alignas(16) float mul[N];
+    alignas(16) float add[N];
+    alignas(16) float lo[N];
+    alignas(16) float hi[N];
+    // All bits set while the voice is in a segment that ends at a bound (attack, decay, release).
+    alignas(16) float moving[N];
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef FINGER_FFT_H
+#define FINGER_FFT_H
+
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include "Simd.h"
+
+// In-place radix-2 complex FFT on split real and imaginary arrays. The bit-reversal table and twiddles
+// are worked out when it is constructed, so transforms don't allocate.
+class Fft {
+public:
+    Fft()
+    : n(0)
+    {
+    }
+
+    explicit Fft(int size)
+    : n(size), reversed(size), twiddleRe(size), twiddleIm(size)
+    {
+        if (size < 4 || (size & (size - 1)) != 0) {
+            throw std::runtime_error("FFT size must be a power of two of at least 4");
+        }
+        int bits = 0;
+        while ((1 << bits) < n) {
+            bits++;
+        }
+        for (int i = 0; i < n; i++) {
+            int r = 0;
+            for (int b = 0; b < bits; b++) {
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            }
+            reversed[i] = r;
+        }
+        // The stage combining halves of length h uses exp(-i pi j / h), j < h, kept at [h, 2h).
+        for (int h = 1; h < n; h *= 2) {
+            for (int j = 0; j < h; j++) {
+                double angle = -M_PI * j / h;
+                twiddleRe[h + j] = (float) std::cos(angle);
+                twiddleIm[h + j] = (float) std::sin(angle);
+            }
+        }
+    }
+
+    int size() const {
+        return n;
+    }
+
+    void forward(float* re, float* im) const {
+        transform(re, im);
+    }
+
+    // Scaled by 1/size, so inverse(forward(x)) gives back x.
+    void inverse(float* re, float* im) const {
+        // Swapping the real and imaginary parts conjugates both input and output (up to a factor of i that
+        // cancels), which turns the forward transform into the inverse one.
+        transform(im, re);
+        float scale = 1.0f / n;
+        for (int i = 0; i < n; i++) {
+            re[i] *= scale;
+            im[i] *= scale;
+        }
+    }
+
+private:
+    void transform(float* re, float* im) const {
+        for (int i = 0; i < n; i++) {
+            int r = reversed[i];
+            if (r > i) {
+                float t = re[i];
+                re[i] = re[r];
+                re[r] = t;
+                t = im[i];
+                im[i] = im[r];
+                im[r] = t;
+            }
+        }
+        for (int h = 1; h < n; h *= 2) {
+            const float* wr = &twiddleRe[h];
+            const float* wi = &twiddleIm[h];
+            for (int s = 0; s < n; s += 2 * h) {
+                float* ar = re + s;
+                float* ai = im + s;
+                float* br = ar + h;
+                float* bi = ai + h;
+                int j = 0;
+#ifdef FINGER_SSE
+                for (; j + 4 <= h; j += 4) {
+                    __m128 xr = _mm_loadu_ps(br + j);
+                    __m128 xi = _mm_loadu_ps(bi + j);
+                    __m128 cr = _mm_loadu_ps(wr + j);
+                    __m128 ci = _mm_loadu_ps(wi + j);
+                    __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, cr), _mm_mul_ps(xi, ci));
+                    __m128 ti = _mm_add_ps(_mm_mul_ps(xr, ci), _mm_mul_ps(xi, cr));
+                    __m128 yr = _mm_loadu_ps(ar + j);
+                    __m128 yi = _mm_loadu_ps(ai + j);
+                    _mm_storeu_ps(br + j, _mm_sub_ps(yr, tr));
+                    _mm_storeu_ps(bi + j, _mm_sub_ps(yi, ti));
+                    _mm_storeu_ps(ar + j, _mm_add_ps(yr, tr));
+                    _mm_storeu_ps(ai + j, _mm_add_ps(yi, ti));
+                }
+#endif
+                for (; j < h; j++) {
+                    float tr = br[j] * wr[j] - bi[j] * wi[j];
+                    float ti = br[j] * wi[j] + bi[j] * wr[j];
+                    br[j] = ar[j] - tr;
+                    bi[j] = ai[j] - ti;
+                    ar[j] += tr;
+                    ai[j] += ti;
+                }
+            }
+        }
+    }
+
+    int n;
+    std::vector<int> reversed;
+    std::vector<float> twiddleRe;
+    std::vector<float> twiddleIm;
+};
+
+#endif
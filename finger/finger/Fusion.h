@@ -0,0 +1,149 @@
+#ifndef FINGER_FUSION_H
+#define FINGER_FUSION_H
+
+#include <stdint.h>
+#include "Clock.h"
+#include "HandFeatures.h"
+
+// One tracked palm: position and velocity in millimetres, grab strength in [0, 1].
+struct PalmSample {
+    float x, y, z;
+    float vx, vy, vz;
+    float grab;
+};
+
+// History of palm samples stamped with host time, stored as structure-of-arrays so scans over one field
+// (timestamps when searching, positions when interpolating) stay contiguous. Oldest samples are overwritten.
+class PalmBuffer {
+public:
+    static const int capacity = 256;
+
+    PalmBuffer()
+    : head(0), count(0)
+    {
+    }
+
+    void push(int64_t frameId, int64_t time, const PalmSample& p) {
+        int i = (head + count) % capacity;
+        if (count == capacity) {
+            head = (head + 1) % capacity;
+        } else {
+            count++;
+        }
+        ids[i] = frameId;
+        times[i] = time;
+        x[i] = p.x;
+        y[i] = p.y;
+        z[i] = p.z;
+        vx[i] = p.vx;
+        vy[i] = p.vy;
+        vz[i] = p.vz;
+        grab[i] = p.grab;
+    }
+
+    int size() const {
+        return count;
+    }
+
+    // Storage slot of sample i counted from the oldest.
+    int slot(int i) const {
+        return (head + i) % capacity;
+    }
+
+    int64_t timeAt(int i) const {
+        return times[slot(i)];
+    }
+
+    // Finds the samples bracketing time t and the blend factor between them. Times outside the buffered
+    // range clamp to the oldest or newest sample. Returns false when the buffer is empty.
+    bool bracket(int64_t t, int& before, int& after, float& blend) const {
+        if (count == 0) {
+            return false;
+        }
+        if (t <= timeAt(0) || count == 1) {
+            before = after = t <= timeAt(0) ? 0 : count - 1;
+            blend = 0;
+            return true;
+        }
+        if (t >= timeAt(count - 1)) {
+            before = after = count - 1;
+            blend = 0;
+            return true;
+        }
+        // Strums look up recent times, so search backwards from the newest sample.
+        int i = count - 1;
+        while (i > 0 && timeAt(i - 1) > t) {
+            i--;
+        }
+        before = i - 1;
+        after = i;
+        int64_t span = timeAt(after) - timeAt(before);
+        blend = span > 0 ? (float) (t - timeAt(before)) / (float) span : 0.0f;
+        return true;
+    }
+
+    int64_t ids[capacity];
+    int64_t times[capacity];
+    float x[capacity], y[capacity], z[capacity];
+    float vx[capacity], vy[capacity], vz[capacity];
+    float grab[capacity];
+
+private:
+    int head;
+    int count;
+};
+
+// Puts the Myo and Leap streams on one host timeline and answers "where was the hand at time t".
+class SensorFusion {
+public:
+    SensorFusion()
+    : handVisible(false)
+    {
+        hand.extended = 0;
+    }
+
+    // Leap side: Controller::now() is on the same clock as Frame::timestamp() and can be sampled at any time,
+    // so a (Controller::now(), hostMicros()) pair taken together is what refines the Leap clock mapping.
+    void syncLeap(int64_t leapNow, int64_t hostNow) {
+        leapClock.observe(leapNow, hostNow);
+    }
+
+    void onLeapFrame(int64_t frameId, int64_t frameTimestamp, const PalmSample& palm) {
+        palms.push(frameId, leapClock.map(frameTimestamp), palm);
+    }
+
+    // Myo side: map an event timestamp, observing its arrival time first.
+    int64_t onMyoEvent(uint64_t timestamp) {
+        myoClock.observe((int64_t) timestamp, hostMicros());
+        return myoClock.map((int64_t) timestamp);
+    }
+
+    // Palm state linearly interpolated to host time t. Returns false if no frames have been seen.
+    bool palmAt(int64_t t, PalmSample& out) const {
+        int before, after;
+        float blend;
+        if (!palms.bracket(t, before, after, blend)) {
+            return false;
+        }
+        int a = palms.slot(before);
+        int b = palms.slot(after);
+        out.x = palms.x[a] + (palms.x[b] - palms.x[a]) * blend;
+        out.y = palms.y[a] + (palms.y[b] - palms.y[a]) * blend;
+        out.z = palms.z[a] + (palms.z[b] - palms.z[a]) * blend;
+        out.vx = palms.vx[a] + (palms.vx[b] - palms.vx[a]) * blend;
+        out.vy = palms.vy[a] + (palms.vy[b] - palms.vy[a]) * blend;
+        out.vz = palms.vz[a] + (palms.vz[b] - palms.vz[a]) * blend;
+        out.grab = palms.grab[a] + (palms.grab[b] - palms.grab[a]) * blend;
+        return true;
+    }
+
+    ClockMapper leapClock;
+    ClockMapper myoClock;
+    PalmBuffer palms;
+
+    // Whether the most recent Leap frame had a hand in it, and that hand's finger configuration.
+    bool handVisible;
+    HandFeatures hand;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef FINGER_HAND_FEATURES_H
+#define FINGER_HAND_FEATURES_H
+
+#include <stdint.h>
+#include "Leap.h"
+
+// Finger configuration of the fret hand, extracted once per Leap frame. Fixed size, so it travels in the
+// LeapFrameRecord alongside the palm.
+struct HandFeatures {
+    // Bit Finger::TYPE_THUMB .. Finger::TYPE_PINKY is set when that finger is extended.
+    uint8_t extended;
+    // Distance from each stabilized fingertip to the palm centre, in millimetres.
+    float tipDistance[5];
+    float pinch;
+    float grab;
+};
+
+inline HandFeatures extractFeatures(const Leap::Hand& hand) {
+    HandFeatures features;
+    features.extended = 0;
+    for (int i = 0; i < 5; i++) {
+        features.tipDistance[i] = 0;
+    }
+
+    const Leap::Vector palm = hand.palmPosition();
+    const Leap::FingerList fingers = hand.fingers();
+    for (int i = 0; i < fingers.count(); i++) {
+        const Leap::Finger finger = fingers[i];
+        int type = finger.type();
+        if (type < Leap::Finger::TYPE_THUMB || type > Leap::Finger::TYPE_PINKY) {
+            continue;
+        }
+        if (finger.isExtended()) {
+            features.extended |= (uint8_t) (1u << type);
+        }
+        features.tipDistance[type] = finger.stabilizedTipPosition().distanceTo(palm);
+    }
+    features.pinch = hand.pinchStrength();
+    features.grab = hand.grabStrength();
+    return features;
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef FINGER_HAPTICS_H
+#define FINGER_HAPTICS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <myo/myo.hpp>
+#include "Clock.h"
+#include "Metronome.h"
+#include "PoseState.h"
+
+// Things to tell an armband. Each one is a round trip through libmyo.
+enum HapticAction {
+    hapticVibrateShort,
+    hapticVibrateMedium,
+    hapticVibrateLong,
+    // Stay unlocked until told otherwise.
+    hapticUnlock,
+    // The pose did something; the armband acknowledges with a short vibration.
+    hapticNotify,
+    hapticActions
+};
+
+struct HapticStats {
+    uint64_t requested;
+    // Requests for an action that was already waiting to go out.
+    uint64_t coalesced;
+    uint64_t sent;
+    // Drains in which an action was held back by its rate limit.
+    uint64_t deferred;
+    // Time spent in libmyo sending them.
+    uint64_t sendNanosTotal;
+    uint64_t sendNanosMax;
+};
+
+// Armband commands, queued from wherever they come up and sent by the thread running the hub, between
+// runOnce() calls, so event callbacks (and the audio thread) never wait on libmyo.
+//
+// The queue is one bit per action per armband: a request sets its bit, drain() sends whatever is set.
+// Asking again for something that hasn't gone out yet costs nothing and sends nothing extra, and any
+// number of threads can request at once without a lock or an allocation. An action also isn't sent until
+// the armband is ready for it; until then it stays queued. The vibrations share one motor, so none starts
+// until the one before has finished, whatever its length; a held unlock and the user action
+// acknowledgement each only need sending now and then.
+class HapticQueue {
+public:
+    static const int maxDevices = PoseState::maxDevices;
+
+    HapticQueue()
+    : requested(0), coalesced(0), sent(0), deferred(0), sendNanosTotal(0), sendNanosMax(0)
+    {
+        for (int d = 0; d < maxDevices; d++) {
+            pending[d].store(0);
+            motorBusyUntil[d] = 0;
+            for (int a = 0; a < hapticActions; a++) {
+                lastSent[d][a] = 0;
+            }
+        }
+    }
+
+    // How long a vibration keeps the motor busy, or for the other actions the minimum time between two of
+    // the same on one armband.
+    static int64_t minInterval(HapticAction action) {
+        static const int64_t micros[hapticActions] = { 150000, 300000, 600000, 1000000, 250000 };
+        return micros[action];
+    }
+
+    // Hub thread only: whether `action` would go out on armband `device` if drained at `now`, rather than wait
+    // out its minimum interval.
+    bool ready(int device, HapticAction action, int64_t now) const {
+        if (vibrates(action)) {
+            return now >= motorBusyUntil[device];
+        }
+        int64_t last = lastSent[device][action];
+        return last == 0 || now - last >= minInterval(action);
+    }
+
+    // Any thread. Returns false if the action was already queued for that armband.
+    bool request(int device, HapticAction action) {
+        if (device < 0 || device >= maxDevices) {
+            return false;
+        }
+        requested.fetch_add(1, std::memory_order_relaxed);
+        uint32_t bit = 1u << action;
+        if (pending[device].fetch_or(bit, std::memory_order_relaxed) & bit) {
+            coalesced.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // Hub thread only, between runOnce() calls: sends what is queued for each armband, myos[d] being
+    // armband d. Returns the number of commands sent.
+    int drain(const std::vector<myo::Myo*>& myos, int64_t now) {
+        int count = 0;
+        int devices = (int) myos.size() < maxDevices ? (int) myos.size() : maxDevices;
+        for (int d = 0; d < devices; d++) {
+            if (pending[d].load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            uint32_t bits = pending[d].exchange(0, std::memory_order_relaxed);
+            uint32_t held = 0;
+            for (int a = 0; a < hapticActions; a++) {
+                if (!(bits & (1u << a))) {
+                    continue;
+                }
+                HapticAction action = (HapticAction) a;
+                if (!ready(d, action, now)) {
+                    held |= 1u << a;
+                    continue;
+                }
+                send(myos[d], action);
+                if (vibrates(action)) {
+                    motorBusyUntil[d] = now + minInterval(action);
+                } else {
+                    lastSent[d][a] = now;
+                }
+                count++;
+            }
+            if (held) {
+                pending[d].fetch_or(held, std::memory_order_relaxed);
+                deferred.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        return count;
+    }
+
+    HapticStats stats() const {
+        HapticStats s;
+        s.requested = requested.load(std::memory_order_relaxed);
+        s.coalesced = coalesced.load(std::memory_order_relaxed);
+        s.sent = sent.load(std::memory_order_relaxed);
+        s.deferred = deferred.load(std::memory_order_relaxed);
+        s.sendNanosTotal = sendNanosTotal.load(std::memory_order_relaxed);
+        s.sendNanosMax = sendNanosMax.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    static bool vibrates(HapticAction action) {
+        return action == hapticVibrateShort || action == hapticVibrateMedium || action == hapticVibrateLong;
+    }
+
+    void send(myo::Myo* myo, HapticAction action) {
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        switch (action) {
+        case hapticVibrateShort:
+            myo->vibrate(myo::Myo::vibrationShort);
+            break;
+        case hapticVibrateMedium:
+            myo->vibrate(myo::Myo::vibrationMedium);
+            break;
+        case hapticVibrateLong:
+            myo->vibrate(myo::Myo::vibrationLong);
+            break;
+        case hapticUnlock:
+            myo->unlock(myo::Myo::unlockHold);
+            break;
+        case hapticNotify:
+            myo->notifyUserAction();
+            break;
+        default:
+            break;
+        }
+        uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        sent.fetch_add(1, std::memory_order_relaxed);
+        sendNanosTotal.fetch_add(nanos, std::memory_order_relaxed);
+        if (nanos > sendNanosMax.load(std::memory_order_relaxed)) {
+            sendNanosMax.store(nanos, std::memory_order_relaxed);
+        }
+    }
+
+    // Actions waiting to go out, a bit per HapticAction, per armband.
+    std::atomic<uint32_t> pending[maxDevices];
+    // Host time the armband's current vibration ends, and each of the other actions last went out; hub
+    // thread only.
+    int64_t motorBusyUntil[maxDevices];
+    int64_t lastSent[maxDevices][hapticActions];
+
+    std::atomic<uint64_t> requested;
+    std::atomic<uint64_t> coalesced;
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> deferred;
+    std::atomic<uint64_t> sendNanosTotal;
+    std::atomic<uint64_t> sendNanosMax;
+};
+
+// Feels the metronome: each beat the mixer renders becomes a short pulse on every armband (a longer one on
+// the downbeat), requested `lead` before the beat plays to make up for the time a command takes to reach
+// the armband. Beats come with their host play time from the audio clock, so the pulses keep to the
+// audio; all the hub thread does is compare a time once per event.
+//
+// A pulse off the beat is worse than none, so a pulse is only requested from the queue when it will go
+// straight out. If an armband's vibration is still inside its minimum interval, the pulse waits for it at
+// most toleranceMicros past when it was due and is then dropped for that armband rather than left queued.
+class HapticMetronome {
+public:
+    static const int maxWaiting = 8;
+    static const int64_t toleranceMicros = 10000;
+
+    explicit HapticMetronome(int64_t lead = 20000)
+    : lead(lead), missed(0), head(0), count(0)
+    {
+    }
+
+    // Takes a beat from Mixer::pollBeat().
+    void add(const Beat& beat) {
+        if (count == maxWaiting) {
+            missed++;
+            return;
+        }
+        int slot = (head + count) % maxWaiting;
+        waiting[slot] = beat;
+        pulsed[slot] = 0;
+        count++;
+    }
+
+    // Hub thread, just before HapticQueue::drain() with the same `now`: requests the pulses that are due
+    // for armbands 0 to devices - 1.
+    void update(HapticQueue& haptics, int devices, int64_t now) {
+        devices = devices < HapticQueue::maxDevices ? devices : HapticQueue::maxDevices;
+        uint32_t all = (1u << devices) - 1;
+        while (count > 0 && waiting[head].time - lead <= now) {
+            const Beat& beat = waiting[head];
+            HapticAction action = beat.downbeat ? hapticVibrateMedium : hapticVibrateShort;
+            bool late = now - (beat.time - lead) > toleranceMicros;
+            for (int d = 0; d < devices && !late; d++) {
+                if (!(pulsed[head] & (1u << d)) && haptics.ready(d, action, now)) {
+                    haptics.request(d, action);
+                    pulsed[head] |= 1u << d;
+                }
+            }
+            if ((pulsed[head] & all) != all) {
+                if (!late) {
+                    // Give the rest another go on the next update.
+                    break;
+                }
+                missed++;
+            }
+            head = (head + 1) % maxWaiting;
+            count--;
+        }
+    }
+
+    int64_t lead;
+    // Beats that didn't get a pulse on every armband, because they came too late or piled up.
+    unsigned int missed;
+
+private:
+    Beat waiting[maxWaiting];
+    // Armbands each waiting beat has been pulsed on, a bit each.
+    uint32_t pulsed[maxWaiting];
+    int head;
+    int count;
+};
+
+#endif
@@ -0,0 +1,583 @@
+#ifndef FINGER_JAM_H
+#define FINGER_JAM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <SFML/Network.hpp>
+#include "Chords.h"
+#include "Clock.h"
+#include "Mixer.h"
+#include "SpscRing.h"
+#include "Wire.h"
+
+const unsigned short jamPort = 47048;
+// WireHeader kind of the jam session stream.
+const uint16_t jamKind = 2;
+
+// Events in a jam datagram. Times are on the sender's clock:
+//
+//   note on:  time it plays at there, velocity in value[0]    note off: time; note -1 is every note
+//   ping:     note is the ping's id; the header's sent time is when it went out
+//   pong:     note is the id of the ping it answers, time is when that ping arrived; the header's sent time
+//             is when the pong went out
+enum JamEventType {
+    jamNoteOn = 1,
+    jamNoteOff,
+    jamPing,
+    jamPong
+};
+
+struct JamConfig {
+    // Port to listen on, and the other players as host[:port].
+    unsigned short port;
+    std::vector<std::string> peers;
+    // Fixed delay added to every remote note on top of its own time, to ride out network jitter.
+    int64_t buffer;
+    // Added to this node's clock as the session sees it. Stands in for rigs whose clocks disagree when
+    // every node runs on one machine.
+    int64_t skew;
+
+    JamConfig()
+    : port(jamPort), buffer(20000), skew(0)
+    {
+    }
+};
+
+struct JamPeerStats {
+    bool synced;
+    // Peer clock less ours, and the round trip of the ping it was worked out from.
+    int64_t offset;
+    int64_t roundTrip;
+    uint64_t notes;
+    // Notes the mixer started after they were due to play, commands it had no room for, and notes that came
+    // before the clocks were synced (those play as they arrive).
+    uint64_t late;
+    uint64_t dropped;
+    uint64_t unsynced;
+    uint64_t lost;
+    // Synced notes the mixer has started; the latency below is over these.
+    uint64_t sounded;
+    // From the peer sending a note to it arriving here, and to the mixer starting it here.
+    int64_t transitTotal;
+    int64_t transitMax;
+    int64_t latencyTotal;
+    int64_t latencyMax;
+};
+
+// Plays with other rigs over UDP. Notes played here are posted by the play loop and sent to every peer;
+// notes from peers go to the mixer, on its remote queue, timed on our host timeline.
+//
+// Each pair of nodes keeps its clocks lined up the way NTP does: every pingMicros a node pings each peer,
+// the peer answers with when the ping arrived and when the answer left, and from the four times the node
+// gets the offset between the clocks and the round trip. Of the last syncSamples exchanges the one with the
+// shortest round trip gives the offset, since queueing only ever lengthens a trip and skews its offset.
+// A remote note then plays at its own time moved onto our clock, plus a fixed jitter buffer: remote notes
+// all sound the same time after they did on the rig that played them, whatever the network did on the
+// way, as long as they arrive within the buffer.
+//
+// One thread does all the networking. It waits on the socket at most pollMicros, so pings are answered as
+// soon as they arrive and notes posted here go out within a millisecond.
+class JamSession {
+public:
+    static const int maxPeers = 8;
+    static const int64_t pingMicros = 200000;
+    static const int64_t pollMicros = 1000;
+    static const int syncSamples = 8;
+
+    explicit JamSession(Mixer& mixer)
+    : mixer(mixer), buffer(0), skew(0), peerCount(0), running(false), queued(0), datagrams(0), errors(0),
+      strays(0)
+    {
+        for (int i = 0; i < onsetSlots; i++) {
+            onsetPeer[i] = -1;
+        }
+    }
+
+    ~JamSession() {
+        stop();
+    }
+
+    void open(const JamConfig& config) {
+        buffer = config.buffer;
+        skew = config.skew;
+        if (socket.bind(config.port) != sf::Socket::Done) {
+            throw std::runtime_error("Unable to listen on the jam port");
+        }
+        socket.setBlocking(false);
+        for (size_t i = 0; i < config.peers.size(); i++) {
+            addPeer(config.peers[i]);
+        }
+    }
+
+    void start() {
+        if (!running && peerCount > 0) {
+            running = true;
+            thread = std::thread(&JamSession::run, this);
+        }
+    }
+
+    void stop() {
+        if (running) {
+            running = false;
+            thread.join();
+        }
+    }
+
+    bool isOpen() const {
+        return peerCount > 0;
+    }
+
+    unsigned short port() const {
+        return socket.getLocalPort();
+    }
+
+    // Play loop thread only: send a note played here to every peer. Returns false if the queue is full.
+    bool post(const NoteCommand& command) {
+        NoteCommand c = command;
+        if (c.time == 0) {
+            c.time = hostMicros();
+        }
+        c.time += (int64_t) c.delay * 1000000 / mixerSampleRate;
+        c.delay = 0;
+        return outgoing.push(c);
+    }
+
+    int peers() const {
+        return peerCount;
+    }
+
+    int64_t bufferMicros() const {
+        return buffer;
+    }
+
+    const std::string& peerName(int i) const {
+        return peerList[i].name;
+    }
+
+    JamPeerStats stats(int i) const {
+        const Peer& p = peerList[i];
+        JamPeerStats s;
+        s.synced = p.synced.load(std::memory_order_relaxed);
+        s.offset = p.offset.load(std::memory_order_relaxed);
+        s.roundTrip = p.roundTrip.load(std::memory_order_relaxed);
+        s.notes = p.notes.load(std::memory_order_relaxed);
+        s.late = p.late.load(std::memory_order_relaxed);
+        s.dropped = p.dropped.load(std::memory_order_relaxed);
+        s.unsynced = p.unsynced.load(std::memory_order_relaxed);
+        s.lost = p.lost.load(std::memory_order_relaxed);
+        s.sounded = p.sounded.load(std::memory_order_relaxed);
+        s.transitTotal = p.transitTotal.load(std::memory_order_relaxed);
+        s.transitMax = p.transitMax.load(std::memory_order_relaxed);
+        s.latencyTotal = p.latencyTotal.load(std::memory_order_relaxed);
+        s.latencyMax = p.latencyMax.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    // Datagrams sent and refused by the socket, and ones received from outside the session or not
+    // understood.
+    uint64_t sentCount() const {
+        return datagrams.load(std::memory_order_relaxed);
+    }
+
+    uint64_t errorCount() const {
+        return errors.load(std::memory_order_relaxed);
+    }
+
+    uint64_t strayCount() const {
+        return strays.load(std::memory_order_relaxed);
+    }
+
+private:
+    static const int pingSlots = 16;
+    // Remote commands whose onset the mixer may not have reported yet. Its report queue is this long.
+    static const int onsetSlots = 256;
+
+    struct Sample {
+        int64_t offset;
+        int64_t delay;
+    };
+
+    struct Peer {
+        Peer()
+        : port(0), sequence(0), nextPing(0), sampleCount(0), nextSample(0), sounding(0), synced(false),
+          offset(0), roundTrip(0), notes(0), late(0), dropped(0), unsynced(0), lost(0), sounded(0),
+          transitTotal(0), transitMax(0), latencyTotal(0), latencyMax(0)
+        {
+            for (int i = 0; i < pingSlots; i++) {
+                pingSent[i] = 0;
+                pingId[i] = 0;
+            }
+        }
+
+        std::string name;
+        sf::IpAddress address;
+        unsigned short port;
+
+        // Network thread only.
+        uint32_t sequence;
+        WireSequence received;
+        uint16_t nextPing;
+        // When each ping still waiting for an answer went out, by id modulo pingSlots.
+        int64_t pingSent[pingSlots];
+        uint16_t pingId[pingSlots];
+        Sample samples[syncSamples];
+        int sampleCount;
+        int nextSample;
+        // Notes it has started since it last released everything, a bit per note.
+        uint32_t sounding;
+
+        std::atomic<bool> synced;
+        std::atomic<int64_t> offset;
+        std::atomic<int64_t> roundTrip;
+        std::atomic<uint64_t> notes;
+        std::atomic<uint64_t> late;
+        std::atomic<uint64_t> dropped;
+        std::atomic<uint64_t> unsynced;
+        std::atomic<uint64_t> lost;
+        std::atomic<uint64_t> sounded;
+        std::atomic<int64_t> transitTotal;
+        std::atomic<int64_t> transitMax;
+        std::atomic<int64_t> latencyTotal;
+        std::atomic<int64_t> latencyMax;
+    };
+
+    void addPeer(const std::string& target) {
+        if (peerCount == maxPeers) {
+            throw std::runtime_error("Too many jam peers");
+        }
+        size_t colon = target.find(':');
+        Peer& peer = peerList[peerCount];
+        peer.address = sf::IpAddress(target.substr(0, colon));
+        peer.port = colon != std::string::npos ? (unsigned short) atoi(target.c_str() + colon + 1) : jamPort;
+        if (peer.address == sf::IpAddress::None || peer.port == 0) {
+            throw std::runtime_error("Unknown jam peer " + target);
+        }
+        peer.name = target;
+        peerCount++;
+    }
+
+    // This node's clock as the session sees it.
+    int64_t clock() const {
+        return hostMicros() + skew;
+    }
+
+    void run() {
+        sf::SocketSelector selector;
+        selector.add(socket);
+        int64_t nextPing = clock();
+        while (running) {
+            if (selector.wait(sf::microseconds(pollMicros))) {
+                receive();
+            }
+            flush();
+            collect();
+            if (clock() >= nextPing) {
+                for (int i = 0; i < peerCount; i++) {
+                    ping(peerList[i]);
+                }
+                nextPing = clock() + pingMicros;
+            }
+        }
+        flush();
+    }
+
+    void receive() {
+        sf::IpAddress from;
+        unsigned short fromPort;
+        size_t size;
+        while (socket.receive(in, sizeof(in), size, from, fromPort) == sf::Socket::Done) {
+            int64_t arrived = clock();
+            Peer* peer = find(from, fromPort);
+            if (!peer || !reader.parse(in, size, wireMagic, jamKind)) {
+                strays.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            peer->received.track(reader.sequence());
+            peer->lost.store(peer->received.lost, std::memory_order_relaxed);
+            for (int i = 0; i < reader.count(); i++) {
+                const WireEvent& e = reader.event(i);
+                if (e.type == jamPing) {
+                    pong(*peer, e.note, arrived);
+                } else if (e.type == jamPong) {
+                    sync(*peer, e.note, reader.time(i), reader.sent(), arrived);
+                } else if (e.type == jamNoteOn || e.type == jamNoteOff) {
+                    play(*peer, e, reader.time(i), reader.sent(), arrived);
+                }
+            }
+        }
+    }
+
+    Peer* find(const sf::IpAddress& address, unsigned short port) {
+        for (int i = 0; i < peerCount; i++) {
+            if (peerList[i].address == address && peerList[i].port == port) {
+                return &peerList[i];
+            }
+        }
+        return NULL;
+    }
+
+    void play(Peer& peer, const WireEvent& e, int64_t time, int64_t sent, int64_t arrived) {
+        NoteCommand command = { e.note, e.value[0], 0, 0, e.type == jamNoteOff };
+        bool timed = false;
+        int64_t sentHere = 0;
+        if (!peer.synced.load(std::memory_order_relaxed)) {
+            if (!command.off) {
+                peer.unsynced.fetch_add(1, std::memory_order_relaxed);
+            }
+        } else {
+            int64_t offset = peer.offset.load(std::memory_order_relaxed);
+            command.time = time - offset + buffer - skew;
+            if (!command.off) {
+                // How late it sounds is only known once the mixer has started it; see collect().
+                timed = true;
+                sentHere = sent - offset;
+                record(peer.transitTotal, peer.transitMax, arrived - sentHere);
+            }
+        }
+
+        if (command.off && command.note < 0) {
+            // Releasing everything would cut off our own notes too; release just the peer's.
+            for (int n = 0; peer.sounding; n++, peer.sounding >>= 1) {
+                if (peer.sounding & 1) {
+                    command.note = n;
+                    queue(peer, command);
+                }
+            }
+            return;
+        }
+        if (command.note < 0 || command.note >= noteCount) {
+            return;
+        }
+        if (command.off) {
+            peer.sounding &= ~(1u << command.note);
+        } else {
+            peer.sounding |= 1u << command.note;
+            peer.notes.fetch_add(1, std::memory_order_relaxed);
+        }
+        queue(peer, command, timed, sentHere);
+    }
+
+    // Hands a command to the mixer and remembers which peer it came from, so the mixer's report on it can
+    // be put down to that peer. A timed note also keeps when it was sent, on our clock.
+    void queue(Peer& peer, const NoteCommand& command, bool timed = false, int64_t sentHere = 0) {
+        if (!mixer.remoteNote(command)) {
+            peer.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        int slot = queued % onsetSlots;
+        onsetIndex[slot] = queued++;
+        onsetPeer[slot] = (int) (&peer - peerList);
+        onsetTimed[slot] = timed;
+        onsetSent[slot] = sentHere;
+    }
+
+    // Takes the mixer's reports on the commands queued so far: ones it had no room for count as dropped,
+    // and timed notes are measured from the peer sending them to the mixer starting them.
+    void collect() {
+        RemoteOnset onset;
+        while (mixer.pollRemoteOnset(onset)) {
+            int slot = onset.index % onsetSlots;
+            if (onsetIndex[slot] != onset.index || onsetPeer[slot] < 0) {
+                continue;
+            }
+            Peer& peer = peerList[onsetPeer[slot]];
+            onsetPeer[slot] = -1;
+            if (onset.dropped) {
+                peer.dropped.fetch_add(1, std::memory_order_relaxed);
+            } else if (onsetTimed[slot]) {
+                record(peer.latencyTotal, peer.latencyMax, onset.time + skew - onsetSent[slot]);
+                peer.sounded.fetch_add(1, std::memory_order_relaxed);
+                if (onset.late) {
+                    peer.late.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    static void record(std::atomic<int64_t>& total, std::atomic<int64_t>& max, int64_t value) {
+        total.fetch_add(value, std::memory_order_relaxed);
+        if (value > max.load(std::memory_order_relaxed)) {
+            max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    void ping(Peer& peer) {
+        uint16_t id = peer.nextPing;
+        peer.nextPing = (peer.nextPing + 1) & 0x7fff;
+        int64_t now = clock();
+        WireWriter writer(out);
+        writer.begin(wireMagic, jamKind, peer.sequence++, now);
+        const float none[4] = { 0, 0, 0, 0 };
+        writer.add(jamPing, id, now, none);
+        peer.pingSent[id % pingSlots] = now;
+        peer.pingId[id % pingSlots] = id;
+        send(peer, writer.finish());
+    }
+
+    void pong(Peer& peer, int id, int64_t arrived) {
+        WireWriter writer(out);
+        writer.begin(wireMagic, jamKind, peer.sequence++, clock());
+        const float none[4] = { 0, 0, 0, 0 };
+        writer.add(jamPong, id, arrived, none);
+        send(peer, writer.finish());
+    }
+
+    // One ping's four times: sent here, arrived there, answered there, answer arrived here.
+    void sync(Peer& peer, int id, int64_t received, int64_t answered, int64_t arrived) {
+        int slot = id % pingSlots;
+        if (id < 0 || peer.pingId[slot] != id || peer.pingSent[slot] == 0) {
+            return;
+        }
+        int64_t sent = peer.pingSent[slot];
+        peer.pingSent[slot] = 0;
+
+        Sample& sample = peer.samples[peer.nextSample];
+        sample.offset = ((received - sent) + (answered - arrived)) / 2;
+        sample.delay = (arrived - sent) - (answered - received);
+        peer.nextSample = (peer.nextSample + 1) % syncSamples;
+        if (peer.sampleCount < syncSamples) {
+            peer.sampleCount++;
+        }
+
+        const Sample* best = &peer.samples[0];
+        for (int i = 1; i < peer.sampleCount; i++) {
+            if (peer.samples[i].delay < best->delay) {
+                best = &peer.samples[i];
+            }
+        }
+        peer.offset.store(best->offset, std::memory_order_relaxed);
+        peer.roundTrip.store(best->delay, std::memory_order_relaxed);
+        peer.synced.store(true, std::memory_order_relaxed);
+    }
+
+    // Sends the notes posted since the last flush to every peer.
+    void flush() {
+        while (!outgoing.empty()) {
+            NoteCommand batch[wireMaxEvents];
+            int count = 0;
+            while (count < wireMaxEvents && outgoing.pop(batch[count])) {
+                count++;
+            }
+            int64_t now = clock();
+            for (int p = 0; p < peerCount; p++) {
+                WireWriter writer(out);
+                writer.begin(wireMagic, jamKind, peerList[p].sequence++, now);
+                for (int i = 0; i < count; i++) {
+                    const NoteCommand& c = batch[i];
+                    float value[4] = { c.velocity, 0, 0, 0 };
+                    writer.add(c.off ? jamNoteOff : jamNoteOn, c.note, c.time + skew, value);
+                }
+                send(peerList[p], writer.finish());
+            }
+        }
+    }
+
+    void send(const Peer& peer, size_t size) {
+        if (socket.send(out, size, peer.address, peer.port) != sf::Socket::Done) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            datagrams.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Mixer& mixer;
+    int64_t buffer;
+    int64_t skew;
+    Peer peerList[maxPeers];
+    int peerCount;
+    std::atomic<bool> running;
+    std::thread thread;
+    SpscRing<NoteCommand, 256> outgoing;
+    // Network thread only.
+    sf::UdpSocket socket;
+    uint64_t in[wireMaxDatagram / 8];
+    uint64_t out[wireMaxDatagram / 8];
+    WireReader reader;
+    // Remote commands queued so far, and the peer (-1 once reported) and send time of each by its index
+    // modulo onsetSlots, the way the mixer numbers them.
+    uint32_t queued;
+    uint32_t onsetIndex[onsetSlots];
+    int onsetPeer[onsetSlots];
+    bool onsetTimed[onsetSlots];
+    int64_t onsetSent[onsetSlots];
+
+    std::atomic<uint64_t> datagrams;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> strays;
+};
+
+// One line per peer: clock sync, what arrived, and how long notes took from leaving the peer to arriving
+// and to the mixer starting them here.
+inline void printJamStats(const JamSession& jam, std::ostream& out) {
+    for (int i = 0; i < jam.peers(); i++) {
+        JamPeerStats s = jam.stats(i);
+        out << "Jam " << jam.peerName(i) << ": ";
+        if (s.synced) {
+            out << "offset " << s.offset / 1000.0 << " ms (round trip " << s.roundTrip / 1000.0 << " ms), ";
+        } else {
+            out << "not synced, ";
+        }
+        int64_t timed = (int64_t) (s.notes - s.unsynced);
+        double transit = timed > 0 ? s.transitTotal / timed / 1000.0 : 0;
+        double latency = s.sounded > 0 ? s.latencyTotal / (int64_t) s.sounded / 1000.0 : 0;
+        out << s.notes << " notes, " << s.late << " late, " << s.dropped << " dropped, " << s.unsynced
+            << " unsynced, " << s.lost << " datagrams lost; network " << transit << " ms (max "
+            << s.transitMax / 1000.0 << "), network to audio " << latency << " ms (max "
+            << s.latencyMax / 1000.0 << ")" << std::endl;
+    }
+}
+
+// Plays made-up strums into a running session for `seconds`, printing the session's counters once a
+// second, then reports. To try a session on one machine, start a few of these with different ports, each
+// naming the others as peers, and a different --jam-skew to see the clock sync at work.
+inline void runJamTest(JamSession& jam, Mixer& mixer, int seconds, int64_t noteLatency, std::ostream& out) {
+    const int64_t strumMicros = 500000;
+    // Each node strums a different chord, so its notes can be told apart by ear.
+    int root = jam.port() % (noteCount - 4);
+    int chord[3] = { root, root + 2, root + 4 };
+    StrumScheduler strummer;
+    NoteCommand notes[3];
+
+    out << "Jam test on port " << jam.port() << " with " << jam.peers() << " peers for " << seconds << " s"
+        << std::endl;
+    int64_t start = hostMicros();
+    // Give the clocks a second to sync first.
+    int64_t nextStrum = start + 1000000;
+    int64_t nextReport = start + 1000000;
+    int strums = 0;
+    for (int64_t now = start; now < start + seconds * (int64_t) 1000000; now = hostMicros()) {
+        if (now >= nextStrum) {
+            bool down = strums++ % 2 == 0;
+            int count = strummer.schedule(chord, 3, 0.7f, down, notes);
+            for (int i = 0; i < count; i++) {
+                notes[i].time = now + noteLatency;
+                mixer.noteOn(notes[i]);
+                jam.post(notes[i]);
+            }
+            nextStrum += strumMicros;
+        }
+        if (now >= nextReport) {
+            printJamStats(jam, out);
+            nextReport += 1000000;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // Let the last notes from the peers arrive and play.
+    std::this_thread::sleep_for(std::chrono::microseconds(noteLatency + jam.bufferMicros() + 200000));
+    jam.stop();
+
+    MixerStats stats = mixer.stats();
+    out << "Jam test done: " << strums << " strums played, " << jam.sentCount() << " datagrams sent, "
+        << jam.errorCount() << " send errors, " << jam.strayCount() << " stray; mixer " << stats.lateNotes
+        << " late notes, " << stats.droppedNotes << " dropped" << std::endl;
+    printJamStats(jam, out);
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef FINGER_LEAP_INGEST_H
+#define FINGER_LEAP_INGEST_H
+
+#include <stdint.h>
+#include "Leap.h"
+#include "Fusion.h"
+#include "SpscRing.h"
+
+// Compact copy of what we use from a Leap frame, small enough to pass between threads by value.
+struct LeapFrameRecord {
+    int64_t id;
+    int64_t timestamp;
+    // Controller::now() and hostMicros() sampled together, for mapping the Leap clock.
+    int64_t leapNow;
+    int64_t hostNow;
+    bool hasHand;
+    PalmSample palm;
+    HandFeatures features;
+};
+
+// Frames travelling from the Leap callback thread to the fusion loop; about four seconds at 60 fps.
+typedef SpscRing<LeapFrameRecord, 256> LeapFrameQueue;
+
+// Turns every Leap frame produced since the previous call into a LeapFrameRecord.
+//
+// Controller::frame(history) keeps the last 60 frames, so if a callback is late (or the caller is a slow
+// polling loop) we walk back through the history by frame ID and catch up on everything we missed.
+class LeapIngest {
+public:
+    // Controller::frame() history depth.
+    static const int historySize = 60;
+
+    LeapIngest()
+    : lastId(-1), received(0), missed(0)
+    {
+    }
+
+    // Returns the number of new frames pushed into the queue.
+    int collect(const Leap::Controller& controller, LeapFrameQueue& queue) {
+        // Walk backwards from the newest frame until we reach one we have already seen.
+        int n = 0;
+        while (n < historySize) {
+            Leap::Frame frame = controller.frame(n);
+            if (!frame.isValid() || frame.id() <= lastId) {
+                break;
+            }
+            pending[n++] = frame;
+        }
+        if (n == 0) {
+            return 0;
+        }
+
+        // Older frames than the history holds are gone for good; count them so a slow consumer shows up.
+        if (lastId >= 0 && pending[n - 1].id() > lastId + 1) {
+            missed += pending[n - 1].id() - lastId - 1;
+        }
+
+        LeapFrameRecord record;
+        record.leapNow = controller.now();
+        record.hostNow = hostMicros();
+        for (int i = n - 1; i >= 0; i--) {
+            const Leap::HandList hands = pending[i].hands();
+            record.id = pending[i].id();
+            record.timestamp = pending[i].timestamp();
+            record.hasHand = !hands.isEmpty();
+            if (record.hasHand) {
+                const Leap::Hand hand = hands[hands.count() - 1];
+                record.palm = sample(hand);
+                record.features = extractFeatures(hand);
+            }
+            queue.push(record);
+        }
+        lastId = pending[0].id();
+        received += n;
+        return n;
+    }
+
+    static PalmSample sample(const Leap::Hand& hand) {
+        const Leap::Vector position = hand.palmPosition();
+        const Leap::Vector velocity = hand.palmVelocity();
+        PalmSample s = { position.x, position.y, position.z, velocity.x, velocity.y, velocity.z,
+                         hand.grabStrength() };
+        return s;
+    }
+
+    int64_t lastId;
+    int64_t received;
+    int64_t missed;
+
+private:
+    Leap::Frame pending[historySize];
+};
+
+// Fusion-loop side: feeds one frame into the fusion stage.
+inline void applyLeapFrame(const LeapFrameRecord& record, SensorFusion& fusion) {
+    fusion.syncLeap(record.leapNow, record.hostNow);
+    fusion.handVisible = record.hasHand;
+    if (record.hasHand) {
+        fusion.onLeapFrame(record.id, record.timestamp, record.palm);
+        fusion.hand = record.features;
+    }
+}
+
+// Feeds every queued frame into the fusion stage, each exactly once and in order.
+inline int drainLeapFrames(LeapFrameQueue& queue, SensorFusion& fusion) {
+    int n = 0;
+    LeapFrameRecord record;
+    while (queue.pop(record)) {
+        applyLeapFrame(record, fusion);
+        n++;
+    }
+    return n;
+}
+
+#endif
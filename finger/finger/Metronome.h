@@ -0,0 +1,120 @@
+#ifndef FINGER_METRONOME_H
+#define FINGER_METRONOME_H
+
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+
+// Practice metronome. A tempo of 0 turns it off; click is the click's peak level (0 for none, 1 for full
+// scale), for hearing the beat as well as feeling it.
+struct MetronomeConfig {
+    double bpm;
+    int beatsPerBar;
+    float click;
+
+    MetronomeConfig()
+    : bpm(0), beatsPerBar(4), click(0)
+    {
+    }
+};
+
+// A beat, at mixer frame `frame`, which plays at host time `time`.
+struct Beat {
+    uint64_t index;
+    uint64_t frame;
+    int64_t time;
+    bool downbeat;
+};
+
+// Beat clock counted in output frames: beat n is at frame round(n * framesPerBeat), worked out from n each
+// time rather than accumulated, so it doesn't drift from the audio however long it runs, and every beat
+// lands on an exact frame. The mixer asks it for the beats in each block it renders and, with a click
+// level set, mixes a short click in at each one.
+class Metronome {
+public:
+    // Long enough for the click to ring out; the shortest beat allowed is longer.
+    static const int clickFrames = 1024;
+    static const int maxBpm = 600;
+
+    Metronome(const MetronomeConfig& config, unsigned int sampleRate)
+    : config(config), framesPerBeat(0), next(0)
+    {
+        if (config.bpm > 0) {
+            double bpm = config.bpm < maxBpm ? config.bpm : maxBpm;
+            framesPerBeat = sampleRate * 60.0 / bpm;
+        }
+        if (config.click > 0) {
+            // Decaying sine bursts, higher on the first beat of the bar.
+            accent.resize(clickFrames);
+            plain.resize(clickFrames);
+            for (int i = 0; i < clickFrames; i++) {
+                double t = (double) i / sampleRate;
+                double envelope = config.click * std::exp(-t / 0.004);
+                accent[i] = (float) (envelope * std::sin(2 * M_PI * 2000 * t));
+                plain[i] = (float) (envelope * std::sin(2 * M_PI * 1200 * t));
+            }
+        }
+    }
+
+    bool enabled() const {
+        return framesPerBeat > 0;
+    }
+
+    uint64_t frameOf(uint64_t beat) const {
+        return (uint64_t) (beat * framesPerBeat + 0.5);
+    }
+
+    bool downbeat(uint64_t beat) const {
+        return config.beatsPerBar <= 1 || beat % config.beatsPerBar == 0;
+    }
+
+    // Audio thread: the next beat starting before frame `end`, if there is one. Each beat is returned once,
+    // in order; `time` is left for the caller.
+    bool due(uint64_t end, Beat& beat) {
+        if (!enabled() || frameOf(next) >= end) {
+            return false;
+        }
+        beat.index = next;
+        beat.frame = frameOf(next);
+        beat.time = 0;
+        beat.downbeat = downbeat(next);
+        next++;
+        return true;
+    }
+
+    // Audio thread: adds the clicks sounding over frames [from, from + frames) into interleaved stereo mix.
+    // Depends only on the frame numbers, so renders don't change with the block size.
+    void click(float* mix, uint64_t from, int frames) const {
+        if (!enabled() || accent.empty()) {
+            return;
+        }
+        uint64_t to = from + frames;
+        // The beat before `from` may still be ringing.
+        uint64_t beat = (uint64_t) (from / framesPerBeat);
+        beat = beat > 0 ? beat - 1 : 0;
+        for (; frameOf(beat) < to; beat++) {
+            uint64_t start = frameOf(beat);
+            if (start + clickFrames <= from) {
+                continue;
+            }
+            const std::vector<float>& table = downbeat(beat) ? accent : plain;
+            uint64_t f = start > from ? start : from;
+            uint64_t stop = start + clickFrames < to ? start + clickFrames : to;
+            for (; f < stop; f++) {
+                float s = table[f - start];
+                mix[2 * (f - from)] += s;
+                mix[2 * (f - from) + 1] += s;
+            }
+        }
+    }
+
+private:
+    MetronomeConfig config;
+    double framesPerBeat;
+    // Index of the next beat due() will return.
+    uint64_t next;
+    std::vector<float> accent;
+    std::vector<float> plain;
+};
+
+#endif
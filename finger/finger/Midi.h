@@ -0,0 +1,601 @@
+#ifndef FINGER_MIDI_H
+#define FINGER_MIDI_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "Chords.h"
+#include "Clock.h"
+#include "Fusion.h"
+#include "Mixer.h"
+#include "SpscRing.h"
+
+// FINGER_ALSA comes from the build; see AudioBackend.h.
+#ifdef FINGER_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+// MIDI status bytes, before the channel is added in.
+const uint8_t midiNoteOff = 0x80;
+const uint8_t midiNoteOn = 0x90;
+const uint8_t midiPitchBend = 0xe0;
+const int midiBendCentre = 8192;
+
+// A three-byte MIDI message due at host time `time`; `posted` is when the play loop queued it.
+struct MidiMessage {
+    int64_t time;
+    int64_t posted;
+    uint8_t status;
+    uint8_t data[2];
+};
+
+struct MidiConfig {
+    // 0-15.
+    int channel;
+    // MIDI note the lowest sample (1A) plays as; A2 by default.
+    int lowestNote;
+    // Bend range the synth is set to, in semitones, so bends come out the size they were meant to be.
+    float bendRange;
+    // Semitones of bend per unit the palm moves along the neck after a strum: sliding the width of one
+    // note's band (see noteForDistance()) bends a whole tone.
+    float bendPerUnit;
+
+    MidiConfig()
+    : channel(0), lowestNote(45), bendRange(2), bendPerUnit(0.5f)
+    {
+    }
+};
+
+// MIDI note for a sample. The samples are a natural scale starting on A.
+inline int midiNoteFor(int note, int lowestNote) {
+    static const int semitones[octaveSteps] = { 0, 2, 3, 5, 7, 8, 10 };
+    int key = lowestNote + 12 * (note / octaveSteps) + semitones[note % octaveSteps];
+    return key < 0 ? 0 : key > 127 ? 127 : key;
+}
+
+// Where the MIDI thread delivers to. send() gets a batch of messages in time order: every message due
+// within lead() of now, so a sink that schedules delivery itself can be given them early and one that
+// can't, with a lead of 0, gets them as they fall due.
+class MidiSink {
+public:
+    virtual ~MidiSink() {
+    }
+
+    virtual const char* name() const = 0;
+    virtual int64_t lead() const = 0;
+    // Returns false if any of the batch couldn't be delivered.
+    virtual bool send(const MidiMessage* messages, int count) = 0;
+};
+
+// Standard MIDI file, format 0, every message at its own time in ticks of 0.5 ms (1000 per quarter note at
+// 120 bpm): a stand-in for a synth when there isn't one, and a record of exactly what was sent. The file is
+// complete after every batch, so a run stopped with ^C loses nothing.
+class MidiFileSink : public MidiSink {
+public:
+    static const int64_t tickMicros = 500;
+
+    explicit MidiFileSink(const std::string& path)
+    : origin(0), lastTick(0)
+    {
+        out.open(path.c_str(), std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("Unable to write MIDI file " + path);
+        }
+        // Format 0, one track, 1000 ticks per quarter note; then the track, with its length filled in later.
+        const uint8_t header[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0x03, 0xe8,
+                                   'M', 'T', 'r', 'k', 0, 0, 0, 0 };
+        out.write((const char*) header, sizeof(header));
+        trackStart = out.tellp();
+        // 500000 us per quarter note.
+        const uint8_t tempo[] = { 0x00, 0xff, 0x51, 0x03, 0x07, 0xa1, 0x20 };
+        out.write((const char*) tempo, sizeof(tempo));
+        endTrack();
+    }
+
+    virtual const char* name() const {
+        return "file";
+    }
+
+    virtual int64_t lead() const {
+        return 0;
+    }
+
+    virtual bool send(const MidiMessage* messages, int count) {
+        // Write over the end of track from the last batch.
+        out.seekp(-(std::streamoff) endOfTrackSize, std::ios::cur);
+        for (int i = 0; i < count; i++) {
+            const MidiMessage& m = messages[i];
+            if (origin == 0) {
+                origin = m.time;
+            }
+            int64_t tick = (m.time - origin) / tickMicros;
+            writeLength(tick > lastTick ? (uint32_t) (tick - lastTick) : 0);
+            lastTick = tick > lastTick ? tick : lastTick;
+            out.put((char) m.status);
+            out.write((const char*) m.data, 2);
+        }
+        endTrack();
+        return (bool) out;
+    }
+
+private:
+    static const int endOfTrackSize = 4;
+
+    // MIDI variable-length quantity: seven bits a byte, most significant first.
+    void writeLength(uint32_t value) {
+        uint8_t bytes[5];
+        int n = 0;
+        do {
+            bytes[n++] = value & 0x7f;
+            value >>= 7;
+        } while (value);
+        while (n > 1) {
+            out.put((char) (bytes[--n] | 0x80));
+        }
+        out.put((char) bytes[0]);
+    }
+
+    void endTrack() {
+        const uint8_t endOfTrack[endOfTrackSize] = { 0x00, 0xff, 0x2f, 0x00 };
+        out.write((const char*) endOfTrack, endOfTrackSize);
+        std::streampos end = out.tellp();
+        uint32_t length = (uint32_t) (end - trackStart);
+        const uint8_t size[] = { (uint8_t) (length >> 24), (uint8_t) (length >> 16), (uint8_t) (length >> 8),
+                                 (uint8_t) length };
+        out.seekp(trackStart - (std::streamoff) 4);
+        out.write((const char*) size, sizeof(size));
+        out.seekp(end);
+        out.flush();
+    }
+
+    std::ofstream out;
+    std::streampos trackStart;
+    int64_t origin;
+    int64_t lastTick;
+};
+
+#ifdef FINGER_ALSA
+// A port on the ALSA sequencer, for a softsynth or a MIDI interface: connect it with aconnect, or name the
+// destination as client:port. Messages are put on a sequencer queue stamped with their own time, and the
+// kernel delivers each one when it falls due however the MIDI thread happens to be scheduled. So the
+// thread hands them over leadMicros early, with one write for the whole batch.
+class AlsaMidiSink : public MidiSink {
+public:
+    static const int64_t leadMicros = 10000;
+
+    explicit AlsaMidiSink(const std::string& destination = "")
+    : seq(NULL), port(-1), queue(-1), origin(0)
+    {
+        int error = snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0);
+        if (error < 0) {
+            throw std::runtime_error(std::string("Unable to open the ALSA sequencer: ") +
+                                     snd_strerror(error));
+        }
+        snd_seq_set_client_name(seq, "finger");
+        port = snd_seq_create_simple_port(seq, "finger", SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+        queue = snd_seq_alloc_named_queue(seq, "finger");
+        if (port < 0 || queue < 0) {
+            snd_seq_close(seq);
+            throw std::runtime_error("Unable to create an ALSA sequencer port");
+        }
+        if (!destination.empty()) {
+            snd_seq_addr_t address;
+            if (snd_seq_parse_address(seq, &address, destination.c_str()) < 0 ||
+                snd_seq_connect_to(seq, port, address.client, address.port) < 0) {
+                snd_seq_close(seq);
+                throw std::runtime_error("Unable to connect to MIDI port " + destination);
+            }
+        }
+        snd_seq_start_queue(seq, queue, NULL);
+        snd_seq_drain_output(seq);
+        // The queue's time 0, on the host timeline.
+        origin = hostMicros();
+    }
+
+    ~AlsaMidiSink() {
+        snd_seq_free_queue(seq, queue);
+        snd_seq_close(seq);
+    }
+
+    virtual const char* name() const {
+        return "alsa";
+    }
+
+    virtual int64_t lead() const {
+        return leadMicros;
+    }
+
+    virtual bool send(const MidiMessage* messages, int count) {
+        int64_t now = hostMicros();
+        bool ok = true;
+        for (int i = 0; i < count; i++) {
+            const MidiMessage& m = messages[i];
+            snd_seq_event_t event;
+            snd_seq_ev_clear(&event);
+            snd_seq_ev_set_source(&event, port);
+            snd_seq_ev_set_subs(&event);
+            if (m.time > now) {
+                int64_t t = m.time - origin;
+                snd_seq_real_time_t at;
+                at.tv_sec = (unsigned int) (t / 1000000);
+                at.tv_nsec = (unsigned int) (t % 1000000 * 1000);
+                snd_seq_ev_schedule_real(&event, queue, 0, &at);
+            } else {
+                snd_seq_ev_set_direct(&event);
+            }
+            int channel = m.status & 0x0f;
+            switch (m.status & 0xf0) {
+            case midiNoteOn:
+                snd_seq_ev_set_noteon(&event, channel, m.data[0], m.data[1]);
+                break;
+            case midiNoteOff:
+                snd_seq_ev_set_noteoff(&event, channel, m.data[0], m.data[1]);
+                break;
+            case midiPitchBend:
+                snd_seq_ev_set_pitchbend(&event, channel, (m.data[0] | m.data[1] << 7) - midiBendCentre);
+                break;
+            default:
+                continue;
+            }
+            ok = snd_seq_event_output(seq, &event) >= 0 && ok;
+        }
+        return snd_seq_drain_output(seq) >= 0 && ok;
+    }
+
+private:
+    snd_seq_t* seq;
+    int port;
+    int queue;
+    int64_t origin;
+};
+#endif
+
+// "alsa", or "alsa:<client>:<port>" to connect straight to that port, for the ALSA sequencer; anything else
+// is a MIDI file to write.
+inline std::unique_ptr<MidiSink> createMidiSink(const std::string& target) {
+    if (target == "alsa" || target.compare(0, 5, "alsa:") == 0) {
+#ifdef FINGER_ALSA
+        return std::unique_ptr<MidiSink>(new AlsaMidiSink(target.size() > 5 ? target.substr(5) : ""));
+#else
+        throw std::runtime_error("ALSA MIDI isn't available in this build");
+#endif
+    }
+    return std::unique_ptr<MidiSink>(new MidiFileSink(target));
+}
+
+struct MidiStats {
+    uint64_t sent;
+    uint64_t batches;
+    // Bends replaced by a later one in the same batch, and messages there was no room to queue.
+    uint64_t coalesced;
+    uint64_t dropped;
+    // Messages handed over more than MidiStream::pollMicros after they were due, and batches the sink
+    // failed to deliver.
+    uint64_t late;
+    uint64_t errors;
+    // From a message being ready to go (posted, and within the sink's lead of its time) to the sink having
+    // it, in microseconds.
+    uint64_t latencyMicrosTotal;
+    uint64_t latencyMicrosMax;
+    // Time spent in the sink per batch.
+    uint64_t sendNanosTotal;
+    uint64_t sendNanosMax;
+};
+
+// Plays what the rig plays on a MIDI synth. The play loop posts notes as it sends them to the mixer, at the
+// same times, with the strum's velocity; and palm samples, which become pitch bend relative to where the
+// palm was at the last strum, so sliding along the neck bends the ringing strings. Posting only pushes onto
+// a lock-free queue.
+//
+// A dedicated thread keeps everything posted in time order and hands the sink each message once it is
+// within the sink's lead of its time, as one batch per wake-up; in a batch, a run of bends goes as its
+// last one. It sleeps until the next message is due, and at most pollMicros, to take new ones.
+class MidiStream {
+public:
+    static const int maxWaiting = 512;
+    static const int64_t pollMicros = 1000;
+
+    explicit MidiStream(const MidiConfig& config = MidiConfig())
+    : config(config), running(false), sounding(0), anchor(-1), lastBend(midiBendCentre), lastPalm(0),
+      waitingCount(0), sent(0), batches(0), coalesced(0), overflowed(0), late(0), errors(0),
+      latencyMicrosTotal(0), latencyMicrosMax(0), sendNanosTotal(0), sendNanosMax(0)
+    {
+    }
+
+    ~MidiStream() {
+        stop();
+    }
+
+    void open(std::unique_ptr<MidiSink> sink) {
+        this->sink = std::move(sink);
+    }
+
+    void start() {
+        if (!running && sink) {
+            running = true;
+            thread = std::thread(&MidiStream::run, this);
+        }
+    }
+
+    // Hands over whatever is still waiting, due or not, before returning.
+    void stop() {
+        if (running) {
+            running = false;
+            thread.join();
+        }
+    }
+
+    bool isOpen() const {
+        return (bool) sink;
+    }
+
+    const char* sinkName() const {
+        return sink ? sink->name() : "none";
+    }
+
+    // Play loop thread only: a note command as given to the mixer. Returns false if any of it was dropped.
+    bool post(const NoteCommand& command) {
+        int64_t time = (command.time != 0 ? command.time : hostMicros()) +
+                       (int64_t) command.delay * 1000000 / mixerSampleRate;
+        if (command.off) {
+            bool ok = true;
+            for (int n = 0; n < noteCount; n++) {
+                if ((sounding & (1u << n)) && (command.note < 0 || command.note == n)) {
+                    ok = message(midiNoteOff, midiNoteFor(n, config.lowestNote), 0, time) && ok;
+                    sounding &= ~(1u << n);
+                }
+            }
+            return ok;
+        }
+        if (command.note < 0 || command.note >= noteCount) {
+            return false;
+        }
+        int key = midiNoteFor(command.note, config.lowestNote);
+        // A string struck again while it still rings: end it first, so every note on has its note off.
+        if (sounding & (1u << command.note)) {
+            message(midiNoteOff, key, 0, time);
+        }
+        sounding |= 1u << command.note;
+        int velocity = (int) (command.velocity * 127 + 0.5f);
+        velocity = velocity < 1 ? 1 : velocity > 127 ? 127 : velocity;
+        return message(midiNoteOn, key, velocity, time);
+    }
+
+    // Play loop thread only: a strum with the palm at `distance`. Bends start again from none at `time`.
+    void strum(float distance, int64_t time) {
+        anchor = std::fabs(distance);
+        bend(0, time);
+    }
+
+    // Play loop thread only: bend by `semitones` from `time`. Only changes are sent.
+    void bend(float semitones, int64_t time) {
+        float range = config.bendRange > 0 ? config.bendRange : 2;
+        int value = midiBendCentre + (int) std::floor(semitones / range * midiBendCentre + 0.5f);
+        value = value < 0 ? 0 : value > 16383 ? 16383 : value;
+        if (value != lastBend) {
+            lastBend = value;
+            message(midiPitchBend, value & 0x7f, value >> 7, time);
+        }
+    }
+
+    // Play loop thread: bends for the palm samples since the last call, each `delay` after the sample, to
+    // line up with notes that sound that long after their strum.
+    void postPalms(const PalmBuffer& palms, int64_t delay) {
+        int first = palms.size();
+        while (first > 0 && palms.timeAt(first - 1) > lastPalm) {
+            first--;
+        }
+        for (int i = first; i < palms.size(); i++) {
+            int s = palms.slot(i);
+            if (anchor >= 0) {
+                bend((std::fabs(palms.z[s]) - anchor) * config.bendPerUnit, palms.times[s] + delay);
+            }
+            lastPalm = palms.times[s];
+        }
+    }
+
+    MidiStats stats() const {
+        MidiStats s;
+        s.sent = sent.load(std::memory_order_relaxed);
+        s.batches = batches.load(std::memory_order_relaxed);
+        s.coalesced = coalesced.load(std::memory_order_relaxed);
+        s.dropped = queue.droppedCount() + overflowed.load(std::memory_order_relaxed);
+        s.late = late.load(std::memory_order_relaxed);
+        s.errors = errors.load(std::memory_order_relaxed);
+        s.latencyMicrosTotal = latencyMicrosTotal.load(std::memory_order_relaxed);
+        s.latencyMicrosMax = latencyMicrosMax.load(std::memory_order_relaxed);
+        s.sendNanosTotal = sendNanosTotal.load(std::memory_order_relaxed);
+        s.sendNanosMax = sendNanosMax.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    bool message(uint8_t status, int first, int second, int64_t time) {
+        MidiMessage m;
+        m.time = time;
+        m.posted = hostMicros();
+        m.status = (uint8_t) (status | (config.channel & 0x0f));
+        m.data[0] = (uint8_t) first;
+        m.data[1] = (uint8_t) second;
+        return queue.push(m);
+    }
+
+    void run() {
+        int64_t lead = sink->lead();
+        while (running) {
+            take();
+            int64_t now = hostMicros();
+            deliver(now + lead, now, lead);
+            int64_t wake = now + pollMicros;
+            if (waitingCount > 0 && waiting[0].time - lead < wake) {
+                wake = waiting[0].time - lead;
+            }
+            now = hostMicros();
+            if (wake > now) {
+                std::this_thread::sleep_for(std::chrono::microseconds(wake - now));
+            }
+        }
+        take();
+        deliver(INT64_MAX, hostMicros(), lead);
+    }
+
+    // Moves newly posted messages into the waiting list, keeping it in time order.
+    void take() {
+        MidiMessage m;
+        while (queue.pop(m)) {
+            if (waitingCount == maxWaiting) {
+                overflowed.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            int i = waitingCount++;
+            while (i > 0 && waiting[i - 1].time > m.time) {
+                waiting[i] = waiting[i - 1];
+                i--;
+            }
+            waiting[i] = m;
+        }
+    }
+
+    // Hands over every waiting message due by `until` as one batch.
+    void deliver(int64_t until, int64_t now, int64_t lead) {
+        int due = 0;
+        while (due < waitingCount && waiting[due].time <= until) {
+            due++;
+        }
+        if (due == 0) {
+            return;
+        }
+        int count = 0;
+        for (int i = 0; i < due; i++) {
+            const MidiMessage& m = waiting[i];
+            if (count > 0 && (m.status & 0xf0) == midiPitchBend && batch[count - 1].status == m.status) {
+                batch[count - 1] = m;
+                coalesced.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            batch[count++] = m;
+        }
+        for (int i = due; i < waitingCount; i++) {
+            waiting[i - due] = waiting[i];
+        }
+        waitingCount -= due;
+
+        for (int i = 0; i < count; i++) {
+            const MidiMessage& m = batch[i];
+            int64_t ready = m.time - lead > m.posted ? m.time - lead : m.posted;
+            uint64_t latency = now > ready ? (uint64_t) (now - ready) : 0;
+            latencyMicrosTotal.fetch_add(latency, std::memory_order_relaxed);
+            if (latency > latencyMicrosMax.load(std::memory_order_relaxed)) {
+                latencyMicrosMax.store(latency, std::memory_order_relaxed);
+            }
+            if (now - m.time > pollMicros) {
+                late.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        if (!sink->send(batch, count)) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        sent.fetch_add(count, std::memory_order_relaxed);
+        batches.fetch_add(1, std::memory_order_relaxed);
+        sendNanosTotal.fetch_add(nanos, std::memory_order_relaxed);
+        if (nanos > sendNanosMax.load(std::memory_order_relaxed)) {
+            sendNanosMax.store(nanos, std::memory_order_relaxed);
+        }
+    }
+
+    MidiConfig config;
+    std::unique_ptr<MidiSink> sink;
+    std::atomic<bool> running;
+    std::thread thread;
+    SpscRing<MidiMessage, 512> queue;
+
+    // Play loop thread only: notes on, a bit per sample; palm distance at the last strum (-1 before the
+    // first); the last bend value posted and the time of the newest palm sample seen.
+    uint32_t sounding;
+    float anchor;
+    int lastBend;
+    int64_t lastPalm;
+
+    // MIDI thread only.
+    MidiMessage waiting[maxWaiting];
+    int waitingCount;
+    MidiMessage batch[maxWaiting];
+
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> batches;
+    std::atomic<uint64_t> coalesced;
+    std::atomic<uint64_t> overflowed;
+    std::atomic<uint64_t> late;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> latencyMicrosTotal;
+    std::atomic<uint64_t> latencyMicrosMax;
+    std::atomic<uint64_t> sendNanosTotal;
+    std::atomic<uint64_t> sendNanosMax;
+};
+
+inline void printMidiStats(const MidiStats& s, std::ostream& out) {
+    out << "MIDI: " << s.sent << " messages in " << s.batches << " batches, " << s.coalesced
+        << " bends coalesced, " << s.late << " late, " << s.dropped << " dropped, " << s.errors
+        << " failed batches; ready to sink " << (s.sent ? s.latencyMicrosTotal / s.sent : 0) << " us (max "
+        << s.latencyMicrosMax << " us), sink " << (s.batches ? s.sendNanosTotal / s.batches / 1000 : 0)
+        << " us per batch (max " << s.sendNanosMax / 1000 << " us)" << std::endl;
+}
+
+// Plays made-up strums through a MidiStream for `seconds` without the sensors: a chord every half second
+// with the velocity rising and falling, released a quarter second later, and a slow bend up and down in
+// between, sampled at the Leap's rate. Then reports what was sent and how long it took.
+inline void runMidiTest(MidiStream& midi, int seconds, int64_t noteLatency, std::ostream& out) {
+    const int64_t strumMicros = 500000;
+    const int64_t palmMicros = 10000;
+    const int chord[3] = { 2, 4, 6 };
+    StrumScheduler strummer;
+    NoteCommand notes[3];
+
+    out << "MIDI test to " << midi.sinkName() << " for " << seconds << " s" << std::endl;
+    int64_t start = hostMicros();
+    int64_t nextStrum = start;
+    int64_t nextRelease = start + strumMicros / 2;
+    int64_t nextPalm = start;
+    int strums = 0;
+    for (int64_t now = start; now < start + seconds * (int64_t) 1000000; now = hostMicros()) {
+        if (now >= nextStrum) {
+            float velocity = 0.3f + 0.7f * (float) (strums % 8) / 7;
+            int count = strummer.schedule(chord, 3, velocity, strums % 2 == 0, notes);
+            midi.strum(20, now + noteLatency);
+            for (int i = 0; i < count; i++) {
+                notes[i].time = now + noteLatency;
+                midi.post(notes[i]);
+            }
+            strums++;
+            nextStrum += strumMicros;
+        }
+        if (now >= nextRelease) {
+            NoteCommand off = { -1, 0, 0, now + noteLatency, true };
+            midi.post(off);
+            nextRelease += strumMicros;
+        }
+        if (now >= nextPalm) {
+            double phase = (double) ((now - start) % strumMicros) / strumMicros;
+            midi.bend((float) std::sin(2 * M_PI * phase), now + noteLatency);
+            nextPalm += palmMicros;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    midi.stop();
+    out << strums << " strums played" << std::endl;
+    printMidiStats(midi.stats(), out);
+}
+
+#endif
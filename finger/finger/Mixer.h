@@ -0,0 +1,526 @@
+#ifndef FINGER_MIXER_H
+#define FINGER_MIXER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <SFML/Audio.hpp>
+#include "Chords.h"
+#include "Clock.h"
+#include "Effects.h"
+#include "Envelope.h"
+#include "Metronome.h"
+#include "NoteBank.h"
+#include "Realtime.h"
+#include "SpscRing.h"
+#include "Streamer.h"
+#include "Voices.h"
+
+// Scale applied to every voice so a full chord doesn't clip.
+const float mixerHeadroom = 0.5f;
+
+// Number of buffers sf::SoundStream keeps queued (SoundStream::BufferCount in SFML 2.3).
+const int streamBuffers = 3;
+
+// Output buffering. Latency is roughly blockFrames * queuedBuffers / mixerSampleRate. SFML always queues
+// streamBuffers blocks, so through the SFML backend blockFrames is the knob; other backends ask the device
+// for queuedBuffers periods of blockFrames. The mixer also uses queuedBuffers to tell when the device's
+// queue must have run dry, so it has to be what the backend really queues: see backendConfig().
+struct MixerConfig {
+    int blockFrames;
+    int queuedBuffers;
+    Adsr envelope;
+    // Which voice a note takes over once all of them are playing.
+    StealPolicy steal;
+    // Effects on the mix bus.
+    EffectsConfig effects;
+    // Beat clock, and the click mixed in after the effects.
+    MetronomeConfig metronome;
+
+    MixerConfig()
+    : blockFrames(512), queuedBuffers(streamBuffers), steal(stealOldest)
+    {
+    }
+};
+
+// Snapshot of the mixer's counters, safe to take from any thread.
+struct MixerStats {
+    uint64_t blocks;
+    // Callbacks that came so late the queued audio must have run out, and ones more than half a block late.
+    uint64_t underruns;
+    uint64_t lateBlocks;
+    uint64_t lateNotes;
+    uint64_t droppedNotes;
+    // Frame the latest note started on.
+    uint64_t lastOnset;
+    // Notes that cut off a voice still playing.
+    uint64_t steals;
+    // Frames streamed voices spent waiting on the disk.
+    uint64_t starvedFrames;
+    // Time spent in render() per block.
+    uint64_t renderNanosLast;
+    uint64_t renderNanosMax;
+    uint64_t renderNanosTotal;
+};
+
+// What the mixer did with a command from its remote queue. `index` counts them in the order they were
+// queued, from 0; `time` is the host time it starts sounding, and `late` is set if that is after the time it
+// asked for. A dropped command never sounds.
+struct RemoteOnset {
+    uint32_t index;
+    int64_t time;
+    bool late;
+    bool dropped;
+};
+
+// Request to start a note at host time `time` (on the hostMicros() timeline) plus `delay` frames.
+// A time of 0 means as soon as possible, i.e. the start of the next block rendered. With `off` set it
+// releases the note instead (every note, if `note` is -1).
+struct NoteCommand {
+    int note;
+    float velocity;
+    uint32_t delay;
+    int64_t time;
+    bool off;
+};
+
+// Turns one strum into a note command per string, a few milliseconds apart like a pick crossing the
+// strings. Downstrokes go low to high, upstrokes high to low; harder strums are tighter and louder.
+class StrumScheduler {
+public:
+    // Gap between neighbouring strings for the slowest and the fastest strum.
+    static const int slowGapMicros = 15000;
+    static const int fastGapMicros = 3000;
+
+    // Fills out with one command per note and returns how many were written.
+    int schedule(const int* notes, int count, float velocity, bool down, NoteCommand* out) const {
+        if (velocity < 0) {
+            velocity = 0;
+        } else if (velocity > 1) {
+            velocity = 1;
+        }
+
+        // Strings in pitch order; chords can come back folded, so sort a copy (at most maxChordNotes).
+        int sorted[maxChordNotes];
+        if (count > maxChordNotes) {
+            count = maxChordNotes;
+        }
+        for (int i = 0; i < count; i++) {
+            int j = i;
+            while (j > 0 && sorted[j - 1] > notes[i]) {
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j] = notes[i];
+        }
+
+        double gapMicros = slowGapMicros + (fastGapMicros - slowGapMicros) * velocity;
+        uint32_t gap = (uint32_t) (gapMicros * mixerSampleRate / 1000000.0);
+        for (int i = 0; i < count; i++) {
+            out[i].note = sorted[down ? i : count - 1 - i];
+            out[i].velocity = velocity;
+            out[i].delay = (uint32_t) i * gap;
+            out[i].time = 0;
+            out[i].off = false;
+        }
+        return count;
+    }
+};
+
+// Software mixer, played by an AudioBackend. renderBlock() runs on the backend's audio thread: it picks up
+// queued note commands, starts each voice at its exact frame offset inside the block and sums the active
+// voices, each shaped by its ADSR envelope. A voice is free again once its sample ends or its release has
+// died away; with all of them busy, MixerConfig::steal decides which one a new note cuts off. The summed mix
+// then goes through the configured effects, and the metronome click, if there is one, is added on top.
+// The control side only ever pushes onto a lock-free queue, so no threads or timers are created per note.
+//
+// Commands are timestamped on the host timeline. The mixer keeps a ClockMapper from its own frame counter
+// to host time, fed with the time the backend expects each block to be heard, and converts each command's
+// time back to an exact frame. Onset jitter is then one sample rather than a buffer period plus thread
+// scheduling. Without a device (offline rendering) the mapping stays the fixed one set by startTimeline(),
+// so the same commands always render the same output.
+class Mixer {
+public:
+    static const int voiceCount = 32;
+    static const int maxPending = 64;
+
+    explicit Mixer(const NoteBank& bank, const MixerConfig& config = MixerConfig())
+    : config(config), bank(bank), streamer(bank, voiceCount), envelopes(mixerSampleRate, config.envelope),
+      effects(config.effects, config.blockFrames), metronome(config.metronome, mixerSampleRate), frame(0),
+      pendingCount(0), remoteCount(0),
+      mix(config.blockFrames * mixerChannels), lastCallback(0),
+      blocks(0), underruns(0), lateBlocks(0), lateNotes(0), droppedNotes(0), lastOnset(0), steals(0),
+      renderNanosLast(0), renderNanosMax(0), renderNanosTotal(0)
+    {
+        if (config.blockFrames <= 0 || config.queuedBuffers <= 0) {
+            throw std::runtime_error("Mixer block size and buffer count must be positive");
+        }
+        startTimeline(hostMicros());
+        for (int i = 0; i < voiceCount; i++) {
+            voices[i].active = false;
+        }
+        for (int i = 0; i < noteCount; i++) {
+            played[i] = 0;
+        }
+        if (bank.streaming()) {
+            streamer.start();
+        }
+    }
+
+    // Pins frame 0 to the given host time. Until a live stream refines it this is the whole mapping.
+    void startTimeline(int64_t host) {
+        clock = ClockMapper();
+        clock.observe(0, host);
+    }
+
+    // Frame that plays at host time `host`.
+    int64_t frameAt(int64_t host) const {
+        return clock.toDevice(host) * (int64_t) mixerSampleRate / 1000000;
+    }
+
+    // Control thread: queue a note. Returns false if the queue is full.
+    bool noteOn(const NoteCommand& command) {
+        return commands.push(command);
+    }
+
+    // Control thread: release `note` (or every note, for -1) at host time `time`, as for noteOn().
+    bool noteOff(int note, int64_t time) {
+        NoteCommand command = { note, 0, 0, time, true };
+        return commands.push(command);
+    }
+
+    // Jam session thread: queue a note (or release) from another player, timed on our host timeline. It has
+    // a queue of its own, so it never shares one with the control thread.
+    bool remoteNote(const NoteCommand& command) {
+        return remote.push(command);
+    }
+
+    // Jam session thread: what became of the next remote command, once the audio thread has scheduled it.
+    // Returns false when there is none waiting. If these aren't taken, later ones are lost.
+    bool pollRemoteOnset(RemoteOnset& onset) {
+        return remoteOnsets.pop(onset);
+    }
+
+    // Any thread: switch an effect off, or back on, from the next block.
+    void bypassEffect(EffectStage stage, bool off) {
+        effects.bypass(stage, off);
+    }
+
+    // Control thread: the next metronome beat rendered, with the host time it plays at. Returns false when
+    // there is none waiting. Once a few beats are waiting, later ones are dropped until they are taken.
+    bool pollBeat(Beat& beat) {
+        return beats.pop(beat);
+    }
+
+    MixerStats stats() const {
+        MixerStats s;
+        s.blocks = blocks.load(std::memory_order_relaxed);
+        s.underruns = underruns.load(std::memory_order_relaxed);
+        s.lateBlocks = lateBlocks.load(std::memory_order_relaxed);
+        s.lateNotes = lateNotes.load(std::memory_order_relaxed);
+        s.droppedNotes = droppedNotes.load(std::memory_order_relaxed);
+        s.lastOnset = lastOnset.load(std::memory_order_relaxed);
+        s.steals = steals.load(std::memory_order_relaxed);
+        s.starvedFrames = streamer.starvedFrames.load(std::memory_order_relaxed);
+        s.renderNanosLast = renderNanosLast.load(std::memory_order_relaxed);
+        s.renderNanosMax = renderNanosMax.load(std::memory_order_relaxed);
+        s.renderNanosTotal = renderNanosTotal.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    int blockFrames() const {
+        return config.blockFrames;
+    }
+
+    // Frames rendered so far; the frame the next render() starts at. For offline use, while not playing.
+    uint64_t position() const {
+        return frame;
+    }
+
+    // Render the next frames of interleaved output. Called from renderBlock(), and usable without an audio
+    // device; longer requests are rendered blockFrames() at a time. Mustn't allocate or lock, which
+    // RealtimeChecks will point out.
+    void render(sf::Int16* out, int frames) {
+        RealtimeScope realtime;
+        while (frames > config.blockFrames) {
+            render(out, config.blockFrames);
+            out += config.blockFrames * mixerChannels;
+            frames -= config.blockFrames;
+        }
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        uint64_t blockStart = frame;
+        uint64_t blockEnd = frame + frames;
+
+        NoteCommand command;
+        while (commands.pop(command)) {
+            schedule(command, blockStart);
+        }
+        while (remote.pop(command)) {
+            int64_t late = schedule(command, blockStart);
+            // A command starts exactly on the frame schedule() gave it, so it is known now when it will sound.
+            RemoteOnset onset = { remoteCount++, 0, late > 0, late < 0 };
+            if (command.time != 0 && late >= 0) {
+                onset.time = command.time + (int64_t) (late + command.delay) * 1000000 / mixerSampleRate;
+            }
+            remoteOnsets.push(onset);
+        }
+
+        for (int i = 0; i < frames * (int) mixerChannels; i++) {
+            mix[i] = 0;
+        }
+
+        // Work through the block one envelope step at a time. Steps are counted from frame 0, not from the
+        // block, so envelopes come out the same however the output is cut into blocks.
+        for (uint64_t f = blockStart; f < blockEnd; ) {
+            uint64_t stepEnd = (f / envelopeStep + 1) * envelopeStep;
+            uint64_t end = stepEnd < blockEnd ? stepEnd : blockEnd;
+            // Slices also end where a command falls due, so a voice that is taken over plays right up to the
+            // frame its new note starts on, wherever the blocks happen to be cut.
+            for (int i = 0; i < pendingCount; i++) {
+                if (pending[i].start > f && pending[i].start < end) {
+                    end = pending[i].start;
+                }
+            }
+
+            // Start and release whatever falls due now, in the order it was queued.
+            for (int i = 0; i < pendingCount; ) {
+                if (pending[i].start <= f) {
+                    apply(pending[i]);
+                    for (int j = i + 1; j < pendingCount; j++) {
+                        pending[j - 1] = pending[j];
+                    }
+                    pendingCount--;
+                } else {
+                    i++;
+                }
+            }
+            for (int v = 0; v < voiceCount; v++) {
+                if (voices[v].active) {
+                    mixVoice(v, f, end, blockStart);
+                }
+            }
+            if (end == stepEnd) {
+                // Voices whose release has finished go back to the pool.
+                uint32_t finished = envelopes.advance();
+                for (int v = 0; finished; v++, finished >>= 1) {
+                    if (finished & 1) {
+                        freeVoice(v);
+                    }
+                }
+                if (config.steal == stealQuietest) {
+                    for (int v = 0; v < voiceCount; v++) {
+                        if (voices[v].active) {
+                            allocator.setLoudness(v, voices[v].gain * envelopes.loudness(v));
+                        }
+                    }
+                    allocator.reheap();
+                }
+            }
+            f = end;
+        }
+        effects.process(&mix[0], frames);
+        metronome.click(&mix[0], blockStart, frames);
+        Beat beat;
+        while (metronome.due(blockEnd, beat)) {
+            beat.time = clock.map(frameMicros(beat.frame));
+            beats.push(beat);
+        }
+        for (int i = 0; i < frames * (int) mixerChannels; i++) {
+            float s = mix[i] * 32767.0f;
+            out[i] = (sf::Int16) (s > 32767.0f ? 32767.0f : s < -32768.0f ? -32768.0f : s);
+        }
+        frame = blockEnd;
+
+        uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        blocks.fetch_add(1, std::memory_order_relaxed);
+        renderNanosLast.store(nanos, std::memory_order_relaxed);
+        renderNanosTotal.fetch_add(nanos, std::memory_order_relaxed);
+        if (nanos > renderNanosMax.load(std::memory_order_relaxed)) {
+            renderNanosMax.store(nanos, std::memory_order_relaxed);
+        }
+    }
+
+    // Audio thread: render the next block for a device that will start playing it at host time `playsAt`.
+    // Keeps the frame-to-host mapping and the underrun counters up to date.
+    void renderBlock(sf::Int16* out, int frames, int64_t playsAt) {
+        RealtimeScope realtime;
+        int64_t now = hostMicros();
+        int64_t blockMicros = (int64_t) frames * 1000000 / mixerSampleRate;
+
+        // Each callback refills one buffer after another has played. Once the gap since the last one exceeds
+        // what was queued, the device had nothing left to play.
+        if (lastCallback != 0) {
+            int64_t gap = now - lastCallback;
+            if (gap > blockMicros * config.queuedBuffers) {
+                underruns.fetch_add(1, std::memory_order_relaxed);
+            } else if (gap > blockMicros * 3 / 2) {
+                lateBlocks.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        lastCallback = now;
+
+        if (frame == 0) {
+            clock = ClockMapper();
+        }
+        clock.observe(frameMicros(frame), playsAt);
+        render(out, frames);
+    }
+
+private:
+    struct Voice {
+        bool active;
+        int note;
+        const sf::Int16* samples;
+        size_t length;
+        // Frames in `samples`; past that the voice plays from its SampleStreamer ring.
+        size_t resident;
+        uint32_t ticket;
+        size_t position;
+        float gain;
+    };
+
+    struct Pending {
+        NoteCommand command;
+        uint64_t start;
+    };
+
+    static int64_t frameMicros(uint64_t f) {
+        return (int64_t) (f * 1000000 / mixerSampleRate);
+    }
+
+    // Turns a queued command into a pending one at its frame, or at the start of the block if that has
+    // already gone. Returns the number of frames it was put back by, or -1 if there was no room for it.
+    int64_t schedule(const NoteCommand& command, uint64_t blockStart) {
+        if (pendingCount == maxPending) {
+            droppedNotes.fetch_add(1, std::memory_order_relaxed);
+            return -1;
+        }
+        int64_t start = command.time != 0 ? frameAt(command.time) : (int64_t) blockStart;
+        int64_t late = 0;
+        if (start < (int64_t) blockStart) {
+            lateNotes.fetch_add(1, std::memory_order_relaxed);
+            late = (int64_t) blockStart - start;
+            start = blockStart;
+        }
+        pending[pendingCount].command = command;
+        pending[pendingCount].start = (uint64_t) start + command.delay;
+        pendingCount++;
+        return late;
+    }
+
+    void apply(const Pending& p) {
+        if (!p.command.off) {
+            startVoice(p.command);
+            lastOnset.store(p.start, std::memory_order_relaxed);
+            return;
+        }
+        for (int v = 0; v < voiceCount; v++) {
+            if (voices[v].active && (p.command.note < 0 || voices[v].note == p.command.note)) {
+                envelopes.release(v);
+            }
+        }
+    }
+
+    void startVoice(const NoteCommand& command) {
+        if (command.note < 0 || command.note >= noteCount) {
+            return;
+        }
+        float gain = command.velocity * mixerHeadroom / 32768.0f;
+        bool stolen;
+        int v = allocator.allocate(command.note, config.steal, gain, stolen);
+        if (stolen) {
+            steals.fetch_add(1, std::memory_order_relaxed);
+        }
+        Voice* voice = &voices[v];
+        voice->active = true;
+        voice->note = command.note;
+        // Velocity picks the layer; each note cycles through its takes so repeats don't sound identical.
+        const NoteSample& sample = bank.select(command.note, command.velocity, played[command.note]++);
+        voice->samples = sample.data;
+        voice->length = sample.frames;
+        voice->resident = sample.resident;
+        voice->ticket = sample.resident < sample.frames ? streamer.begin(v, sample) : 0;
+        voice->position = 0;
+        voice->gain = gain;
+        envelopes.start(v);
+    }
+
+    // Mixes voice v over frames [from, to) of the block starting at blockStart; the range never crosses an
+    // envelope step, so the envelope is a straight ramp across it.
+    void mixVoice(int v, uint64_t from, uint64_t to, uint64_t blockStart) {
+        Voice& voice = voices[v];
+        int i = (int) (from - blockStart);
+        int frames = (int) (to - blockStart);
+        // Gain is worked out from the step start for every frame rather than accumulated, so it doesn't
+        // depend on where the slice begins.
+        float base = voice.gain * envelopes.level[v];
+        float slope = voice.gain * envelopes.slope(v);
+        int step = (int) (from % envelopeStep);
+        for (; i < frames && voice.position < voice.resident; i++, step++, voice.position++) {
+            float gain = base + slope * step;
+            for (unsigned int c = 0; c < mixerChannels; c++) {
+                mix[i * mixerChannels + c] += voice.samples[voice.position * mixerChannels + c] * gain;
+            }
+        }
+        if (i < frames && voice.position < voice.length) {
+            bool done;
+            int n = streamer.read(v, voice.ticket, &mix[i * mixerChannels], frames - i, base, slope, step, done);
+            voice.position += n;
+            if (done) {
+                voice.position = voice.length;
+            } else if (i + n < frames) {
+                streamer.starvedFrames.fetch_add(frames - i - n, std::memory_order_relaxed);
+            }
+        }
+        if (voice.position >= voice.length) {
+            envelopes.stop(v);
+            freeVoice(v);
+        }
+    }
+
+    void freeVoice(int v) {
+        voices[v].active = false;
+        allocator.free(v);
+    }
+
+    MixerConfig config;
+    const NoteBank& bank;
+    SampleStreamer streamer;
+    EnvelopeBank<voiceCount> envelopes;
+    VoiceAllocator<voiceCount> allocator;
+    EffectsChain effects;
+    Metronome metronome;
+    SpscRing<Beat, 8> beats;
+    ClockMapper clock;
+    SpscRing<NoteCommand, 256> commands;
+    SpscRing<NoteCommand, 256> remote;
+    SpscRing<RemoteOnset, 256> remoteOnsets;
+    Pending pending[maxPending];
+    Voice voices[voiceCount];
+    // Times each note has been started, for round-robin.
+    uint32_t played[noteCount];
+    uint64_t frame;
+    int pendingCount;
+    // Remote commands taken off the queue so far.
+    uint32_t remoteCount;
+    // Sized once from the config; render() never resizes them.
+    std::vector<float> mix;
+    int64_t lastCallback;
+
+    std::atomic<uint64_t> blocks;
+    std::atomic<uint64_t> underruns;
+    std::atomic<uint64_t> lateBlocks;
+    std::atomic<uint64_t> lateNotes;
+    std::atomic<uint64_t> droppedNotes;
+    std::atomic<uint64_t> lastOnset;
+    std::atomic<uint64_t> steals;
+    std::atomic<uint64_t> renderNanosLast;
+    std::atomic<uint64_t> renderNanosMax;
+    std::atomic<uint64_t> renderNanosTotal;
+};
+
+#endif
@@ -0,0 +1,356 @@
+#ifndef FINGER_NOTE_BANK_H
+#define FINGER_NOTE_BANK_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <SFML/Audio.hpp>
+#include "Chords.h"
+
+// Output format of the mixer; the note samples are recorded in the same format.
+const unsigned int mixerSampleRate = 44100;
+const unsigned int mixerChannels = 2;
+
+// Each note can have several velocity layers (soft to hard) and several round-robin takes per layer, so
+// repeated strums don't sound identical. On disk the takes sit next to the plain note file:
+//
+//   1A.wav  1A_r2.wav  1A_r3.wav      softest layer (1), takes 1-3
+//   1A_v2.wav  1A_v2_r2.wav ...       layer 2, and so on up to maxVelocityLayers
+//
+// Every layer of a note must have the same number of takes.
+const int maxVelocityLayers = 4;
+const int maxRoundRobin = 4;
+
+inline std::string noteSampleFile(int note, int layer, int take) {
+    std::string name = noteFiles[note];
+    name = name.substr(0, name.size() - 4);
+    char suffix[16];
+    if (layer > 0) {
+        snprintf(suffix, sizeof(suffix), "_v%d", layer + 1);
+        name += suffix;
+    }
+    if (take > 0) {
+        snprintf(suffix, sizeof(suffix), "_r%d", take + 1);
+        name += suffix;
+    }
+    return name + ".wav";
+}
+
+// One recorded take, interleaved at the mixer format. When the bank streams, only the first `resident`
+// frames are in `data`; SampleStreamer reads the rest from the take's file while it plays.
+struct NoteSample {
+    const sf::Int16* data;
+    size_t frames;
+    size_t resident;
+    // Position in the bank, for NoteBank::path().
+    uint32_t index;
+};
+
+// Packed note bank: every take of every note in one file, laid out so it can be mapped and played in place.
+//
+//   PackedBankHeader
+//   PackedNote[noteCount]
+//   PackedSample[sampleCount], note by note, layer by layer, take by take
+//   interleaved 16-bit PCM for each sample, each starting on a packedAlignment boundary
+//
+// All fields are little-endian, which is what every machine we run on is.
+struct PackedBankHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t noteCount;
+    uint32_t sampleRate;
+    uint32_t channels;
+    uint32_t sampleCount;
+    uint32_t reserved;
+    uint64_t tableOffset;
+    uint64_t fileSize;
+};
+
+static_assert(sizeof(PackedBankHeader) == 48, "PackedBankHeader must have no padding");
+
+struct PackedNote {
+    // Index of the note's first PackedSample; it has layers * takes of them.
+    uint32_t first;
+    uint16_t layers;
+    uint16_t takes;
+};
+
+struct PackedSample {
+    // Byte offset of the first sample from the start of the file.
+    uint64_t offset;
+    uint64_t frames;
+};
+
+const char packedBankMagic[8] = { 'F', 'N', 'G', 'R', 'B', 'A', 'N', 'K' };
+const uint32_t packedBankVersion = 2;
+// Cache line; the mapping itself is page aligned.
+const uint64_t packedAlignment = 64;
+
+inline uint64_t residentFrames(uint64_t frames, uint64_t headFrames) {
+    return headFrames != 0 && headFrames < frames ? headFrames : frames;
+}
+
+// Finds and decodes every layer and take of every note in `dir` into one buffer, keeping only the first
+// headFrames of each if that isn't 0. The table has each take's full length and its offset in samples from
+// the start of `pcm`, each starting on a packedAlignment boundary.
+inline void decodeNoteFiles(const std::string& dir, uint64_t headFrames, std::vector<sf::Int16>& pcm,
+                            PackedNote* layout, std::vector<PackedSample>& table, std::vector<std::string>& files) {
+    const uint64_t align = packedAlignment / sizeof(sf::Int16);
+    files.clear();
+    for (int i = 0; i < noteCount; i++) {
+        int takes = 0;
+        while (takes < maxRoundRobin && std::ifstream((dir + "/" + noteSampleFile(i, 0, takes)).c_str())) {
+            takes++;
+        }
+        int layers = takes > 0 ? 1 : 0;
+        while (layers < maxVelocityLayers && std::ifstream((dir + "/" + noteSampleFile(i, layers, 0)).c_str())) {
+            layers++;
+        }
+        if (takes == 0) {
+            throw std::runtime_error("Unable to load " + dir + "/" + noteFiles[i]);
+        }
+        layout[i].first = (uint32_t) files.size();
+        layout[i].layers = (uint16_t) layers;
+        layout[i].takes = (uint16_t) takes;
+        for (int l = 0; l < layers; l++) {
+            for (int t = 0; t < takes; t++) {
+                files.push_back(dir + "/" + noteSampleFile(i, l, t));
+            }
+        }
+    }
+
+    // Size everything first so the PCM lands in a single allocation.
+    table.resize(files.size());
+    uint64_t end = 0;
+    for (size_t s = 0; s < files.size(); s++) {
+        sf::InputSoundFile in;
+        if (!in.openFromFile(files[s])) {
+            throw std::runtime_error("Unable to load " + files[s] + " (every layer needs the same takes)");
+        }
+        if (in.getChannelCount() != mixerChannels || in.getSampleRate() != mixerSampleRate) {
+            throw std::runtime_error("Unexpected sample format in " + files[s]);
+        }
+        table[s].offset = (end + align - 1) / align * align;
+        table[s].frames = in.getSampleCount() / mixerChannels;
+        end = table[s].offset + residentFrames(table[s].frames, headFrames) * mixerChannels;
+    }
+    pcm.assign((size_t) end, 0);
+    for (size_t s = 0; s < files.size(); s++) {
+        sf::InputSoundFile in;
+        sf::Uint64 count = residentFrames(table[s].frames, headFrames) * mixerChannels;
+        if (!in.openFromFile(files[s]) || (count > 0 && in.read(&pcm[(size_t) table[s].offset], count) != count)) {
+            throw std::runtime_error("Unable to read " + files[s]);
+        }
+    }
+}
+
+// Note samples, interleaved stereo at the mixer rate. Either decoded from the WAVs into one contiguous pool
+// at startup or mapped straight out of a packed bank; in both cases a note's layers and takes sit side by
+// side in memory.
+class NoteBank {
+public:
+    NoteBank()
+    : streamed(false), mapping(0), mappingSize(0)
+    {
+        for (int i = 0; i < noteCount; i++) {
+            notes[i].first = 0;
+            notes[i].layers = 0;
+            notes[i].takes = 0;
+        }
+    }
+
+    ~NoteBank() {
+        unmap();
+    }
+
+    // Decode the note files in directory `dir`. With a nonzero headMillis only that much of each take is
+    // kept in memory and the rest is streamed from disk as it plays.
+    void load(const std::string& dir = ".", int headMillis = 0) {
+        uint64_t head = (uint64_t) headMillis * mixerSampleRate / 1000;
+        std::vector<sf::Int16> decoded;
+        std::vector<PackedSample> table;
+        PackedNote layout[noteCount];
+        decodeNoteFiles(dir, head, decoded, layout, table, paths);
+
+        unmap();
+        pool.swap(decoded);
+        samples.resize(table.size());
+        streamed = false;
+        for (size_t s = 0; s < table.size(); s++) {
+            samples[s].data = &pool[table[s].offset];
+            samples[s].frames = (size_t) table[s].frames;
+            samples[s].resident = (size_t) residentFrames(table[s].frames, head);
+            samples[s].index = (uint32_t) s;
+            streamed = streamed || samples[s].resident < samples[s].frames;
+        }
+        for (int i = 0; i < noteCount; i++) {
+            notes[i] = layout[i];
+        }
+    }
+
+    // Map a bank written by packNoteBank(). Nothing is read or decoded up front: the kernel pages samples in
+    // as the mixer first touches them, and shares them with every other process using the same bank.
+    void loadPacked(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Unable to open note bank " + path);
+        }
+        struct stat st;
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(PackedBankHeader)) {
+            p = mmap(0, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Unable to map note bank " + path);
+        }
+        unmap();
+        std::vector<sf::Int16>().swap(pool);
+        paths.clear();
+        streamed = false;
+        mapping = p;
+        mappingSize = (size_t) st.st_size;
+        // Start reading the whole bank in the background so the first notes don't fault on the audio thread.
+        madvise(mapping, mappingSize, MADV_WILLNEED);
+
+        const char* base = (const char*) mapping;
+        const PackedBankHeader* header = (const PackedBankHeader*) base;
+        if (memcmp(header->magic, packedBankMagic, sizeof(packedBankMagic)) != 0
+            || header->fileSize != mappingSize) {
+            throw std::runtime_error("Invalid note bank " + path);
+        }
+        if (header->version != packedBankVersion) {
+            throw std::runtime_error("Note bank " + path + " is from another version; pack it again");
+        }
+        if (header->noteCount != (uint32_t) noteCount || header->sampleRate != mixerSampleRate
+            || header->channels != mixerChannels) {
+            throw std::runtime_error("Note bank " + path + " doesn't match the mixer format");
+        }
+        uint64_t tableEnd = header->tableOffset + noteCount * sizeof(PackedNote)
+            + header->sampleCount * (uint64_t) sizeof(PackedSample);
+        if (tableEnd > mappingSize) {
+            throw std::runtime_error("Truncated note bank " + path);
+        }
+
+        const PackedNote* layout = (const PackedNote*) (base + header->tableOffset);
+        const PackedSample* table = (const PackedSample*) (layout + noteCount);
+        for (int i = 0; i < noteCount; i++) {
+            const PackedNote& n = layout[i];
+            if (n.layers < 1 || n.layers > maxVelocityLayers || n.takes < 1 || n.takes > maxRoundRobin
+                || n.first + (uint64_t) n.layers * n.takes > header->sampleCount) {
+                throw std::runtime_error("Corrupt note table in " + path);
+            }
+            notes[i] = n;
+        }
+        samples.resize(header->sampleCount);
+        for (uint32_t s = 0; s < header->sampleCount; s++) {
+            uint64_t bytes = table[s].frames * mixerChannels * sizeof(sf::Int16);
+            if (table[s].offset % packedAlignment != 0 || table[s].offset + bytes > mappingSize) {
+                throw std::runtime_error("Corrupt sample table in " + path);
+            }
+            samples[s].data = (const sf::Int16*) (base + table[s].offset);
+            samples[s].frames = (size_t) table[s].frames;
+            samples[s].resident = samples[s].frames;
+            samples[s].index = s;
+        }
+    }
+
+    // The take to play for a note at velocity 0..1. `count` is how many times the note has been played
+    // before; consecutive counts cycle through the layer's takes.
+    const NoteSample& select(int note, float velocity, uint32_t count) const {
+        const PackedNote& n = notes[note];
+        int layer = (int) (velocity * n.layers);
+        layer = layer < 0 ? 0 : layer >= n.layers ? n.layers - 1 : layer;
+        return samples[n.first + layer * n.takes + count % n.takes];
+    }
+
+    int layers(int note) const {
+        return notes[note].layers;
+    }
+
+    int takes(int note) const {
+        return notes[note].takes;
+    }
+
+    // Whether any take has more frames than are resident.
+    bool streaming() const {
+        return streamed;
+    }
+
+    // File a take was decoded from; only for banks loaded with load().
+    const std::string& path(uint32_t index) const {
+        return paths[index];
+    }
+
+private:
+    NoteBank(const NoteBank&);
+    NoteBank& operator=(const NoteBank&);
+
+    void unmap() {
+        if (mapping) {
+            munmap(mapping, mappingSize);
+            mapping = 0;
+        }
+    }
+
+    PackedNote notes[noteCount];
+    std::vector<NoteSample> samples;
+    // Decoded PCM when loaded from WAVs; empty when mapped.
+    std::vector<sf::Int16> pool;
+    std::vector<std::string> paths;
+    bool streamed;
+    void* mapping;
+    size_t mappingSize;
+};
+
+// Packs the note files in directory `dir` into a bank at `path` for NoteBank::loadPacked(). Any format
+// sf::InputSoundFile reads is accepted, as long as it is already at the mixer's rate and channel count.
+inline void packNoteBank(const std::string& dir, const std::string& path) {
+    std::vector<sf::Int16> pcm;
+    std::vector<PackedSample> table;
+    PackedNote layout[noteCount];
+    std::vector<std::string> files;
+    decodeNoteFiles(dir, 0, pcm, layout, table, files);
+
+    PackedBankHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, packedBankMagic, sizeof(packedBankMagic));
+    header.version = packedBankVersion;
+    header.noteCount = noteCount;
+    header.sampleRate = mixerSampleRate;
+    header.channels = mixerChannels;
+    header.sampleCount = (uint32_t) table.size();
+    header.tableOffset = sizeof(PackedBankHeader);
+
+    // The decoded layout is already aligned; shift it past the tables, keeping the alignment.
+    uint64_t tableEnd = header.tableOffset + sizeof(layout) + table.size() * sizeof(PackedSample);
+    uint64_t data = (tableEnd + packedAlignment - 1) / packedAlignment * packedAlignment;
+    for (size_t s = 0; s < table.size(); s++) {
+        table[s].offset = data + table[s].offset * sizeof(sf::Int16);
+    }
+    header.fileSize = data + pcm.size() * sizeof(sf::Int16);
+
+    std::ofstream out(path.c_str(), std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Unable to write note bank " + path);
+    }
+    const char padding[packedAlignment] = { 0 };
+    out.write((const char*) &header, sizeof(header));
+    out.write((const char*) layout, sizeof(layout));
+    out.write((const char*) table.data(), (std::streamsize) (table.size() * sizeof(PackedSample)));
+    out.write(padding, (std::streamsize) (data - tableEnd));
+    out.write((const char*) pcm.data(), (std::streamsize) (pcm.size() * sizeof(sf::Int16)));
+    if (!out) {
+        throw std::runtime_error("Unable to write note bank " + path);
+    }
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef FINGER_PERFORMANCE_H
+#define FINGER_PERFORMANCE_H
+
+#include <stdint.h>
+#include <ostream>
+#include "Chords.h"
+#include "Fusion.h"
+#include "Jam.h"
+#include "Midi.h"
+#include "Mixer.h"
+#include "Visualizer.h"
+
+// What the strumming arm looks like at one pass of the main loop.
+struct ArmState {
+    // hostMicros() when the loop iteration ran.
+    int64_t host;
+    float pitch;
+    bool fist;
+    // Host time of the latest change in pitch, from SensorFusion::onMyoEvent().
+    int64_t pitchChangedAt;
+};
+
+// The detection -> note stage of the main loop: a strum is the arm moving in pitch while the Myo hand is in a
+// fist; the Leap hand picks the chord. It only reads its inputs, so a recorded session run through it again
+// produces exactly the same notes as it did live.
+class Performance {
+public:
+    explicit Performance(int64_t noteLatency)
+    : noteLatency(noteLatency), log(0), visual(0), jam(0), midi(0), pitch(0), fist(false), seed(1)
+    {
+    }
+
+    // Arm position before the first update().
+    void begin(float startPitch) {
+        pitch = startPitch;
+    }
+
+    // Returns the number of notes sent to the mixer.
+    int update(const ArmState& arm, const SensorFusion& fusion, Mixer& mixer) {
+        double foo = 0;
+        if (fusion.handVisible) {
+            foo = fusion.palms.z[fusion.palms.slot(fusion.palms.size() - 1)];
+            if (log) {
+                *log << foo << std::endl;
+            }
+        }
+
+        float move_pitch = arm.pitch - pitch < 0 ? pitch - arm.pitch : arm.pitch - pitch;
+        // The arm coming down is a downstroke; a bigger swing per iteration is a harder strum.
+        bool down = arm.pitch < pitch;
+        float velocity = move_pitch / 4;
+        pitch = arm.pitch; // pitch should be around ~ 5+ difference
+
+        // Opening the hand lets the strings ring out: release whatever is still sounding.
+        if (fist && !arm.fist) {
+            mixer.noteOff(-1, arm.host + noteLatency);
+            NoteCommand off = { -1, 0, 0, arm.host + noteLatency, true };
+            if (jam) {
+                jam->post(off);
+            }
+            if (midi) {
+                midi->post(off);
+            }
+            if (visual) {
+                visual->post(visualNoteOff, -1, arm.host + noteLatency);
+            }
+        }
+        fist = arm.fist;
+
+        // Use where the hand was when the pitch moved, not where it is now.
+        PalmSample palm;
+        if (move_pitch >= 1 && fusion.handVisible && fusion.palmAt(arm.pitchChangedAt, palm)) {
+            foo = palm.z;
+        }
+        if (foo < 0) {
+            foo = foo * -1;
+        }
+
+        if (arm.fist && move_pitch >= 1 && foo > 0) {
+            // The palm distance picks the root, the fret hand's fingers pick the chord on it.
+            int count = chords.chord(noteForDistance((int) foo), fusion.hand.extended, notes);
+            if (log) {
+                *log << "FISTBUMP! " << chords.voicing(fusion.hand.extended).name << std::endl;
+            }
+            count = strummer.schedule(notes, count, velocity, down, strum);
+            if (midi) {
+                midi->strum((float) foo, arm.pitchChangedAt + noteLatency);
+            }
+            for (int i = 0; i < count; i++) {
+                strum[i].time = arm.pitchChangedAt + noteLatency;
+                mixer.noteOn(strum[i]);
+                if (jam) {
+                    jam->post(strum[i]);
+                }
+                if (midi) {
+                    midi->post(strum[i]);
+                }
+            }
+            if (visual) {
+                visual->post(visualStrum, 0, arm.pitchChangedAt, velocity, down ? 1.0f : 0.0f);
+                for (int i = 0; i < count; i++) {
+                    visual->post(visualNoteOn, strum[i].note, strum[i].time, strum[i].velocity);
+                }
+            }
+            return count;
+        } else if (arm.fist && move_pitch >= 1) {
+            NoteCommand open = { noteForDistance(nextRandom() % 64 + 4), velocity > 1 ? 1 : velocity, 0,
+                                 arm.pitchChangedAt + noteLatency, false }; // open note lel
+            // The draw runs a couple of bands past the last note, and those strums play nothing.
+            if (open.note < 0) {
+                return 0;
+            }
+            mixer.noteOn(open);
+            if (jam) {
+                jam->post(open);
+            }
+            if (midi) {
+                midi->post(open);
+            }
+            if (visual) {
+                visual->post(visualNoteOn, open.note, open.time, open.velocity);
+            }
+            if (log) {
+                *log << ":(" << std::endl;
+            }
+            return 1;
+        }
+        return 0;
+    }
+
+    // Fixed delay from the strum to the note; long enough to cover one loop iteration so every note sounds
+    // the same time after its strum.
+    int64_t noteLatency;
+    // Where to print what was played, if anywhere.
+    std::ostream* log;
+    // Where to stream what was played for the visualizer, if anywhere.
+    VisualizerStream* visual;
+    // Session to send what was played to the other players in, if any.
+    JamSession* jam;
+    // Synth to play the same notes on over MIDI, if any.
+    MidiStream* midi;
+
+private:
+    // Our own generator rather than rand(), so a replay picks the same open notes.
+    int nextRandom() {
+        seed = seed * 1103515245u + 12345u;
+        return (int) ((seed >> 16) & 0x7fff);
+    }
+
+    ChordRecognizer chords;
+    StrumScheduler strummer;
+    int notes[maxChordNotes];
+    NoteCommand strum[maxChordNotes];
+    float pitch;
+    bool fist;
+    uint32_t seed;
+};
+
+#endif
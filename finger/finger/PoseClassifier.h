@@ -0,0 +1,372 @@
+#ifndef FINGER_POSE_CLASSIFIER_H
+#define FINGER_POSE_CLASSIFIER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <myo/myo.hpp>
+
+// The Myo armband streams 8 EMG channels at 200 Hz when setStreamEmg(streamEmgEnabled) is set.
+const int emgChannels = 8;
+
+// Number of EMG samples in one analysis window (200 ms at 200 Hz).
+const int emgWindowSize = 40;
+
+// Features computed over one window: the mean absolute value of each channel.
+struct EmgFeatures {
+    float values[emgChannels];
+};
+
+// Sliding window over the raw EMG stream. The per-channel sums are kept up to date as samples come in,
+// so pushing a sample and reading the features are both O(channels) and never allocate.
+class EmgWindow {
+public:
+    EmgWindow()
+    : head(0), filled(0)
+    {
+        for (int c = 0; c < emgChannels; c++) {
+            sums[c] = 0;
+            for (int i = 0; i < emgWindowSize; i++) {
+                samples[i][c] = 0;
+            }
+        }
+    }
+
+    void push(const int8_t* emg) {
+        for (int c = 0; c < emgChannels; c++) {
+            int value = emg[c] < 0 ? -emg[c] : emg[c];
+            sums[c] += value - samples[head][c];
+            samples[head][c] = (uint8_t) value;
+        }
+        head = (head + 1) % emgWindowSize;
+        if (filled < emgWindowSize) {
+            filled++;
+        }
+    }
+
+    bool full() const {
+        return filled == emgWindowSize;
+    }
+
+    void features(EmgFeatures& out) const {
+        // Scale to roughly [0, 1] so the model coefficients stay in a sane range.
+        const float scale = 1.0f / (128.0f * emgWindowSize);
+        for (int c = 0; c < emgChannels; c++) {
+            out.values[c] = sums[c] * scale;
+        }
+    }
+
+private:
+    uint8_t samples[emgWindowSize][emgChannels];
+    int sums[emgChannels];
+    int head;
+    int filled;
+};
+
+// A labelled feature vector recorded during calibration.
+struct EmgExample {
+    myo::Pose::Type label;
+    EmgFeatures features;
+};
+
+// Linear pose classifier over EmgFeatures, trained with linear discriminant analysis (shared covariance).
+// Classifying a window is one dot product per pose, which runs in well under a microsecond.
+class PoseClassifier {
+public:
+    // Maximum number of poses a model can distinguish (every myo::Pose::Type except unknown).
+    static const int maxPoses = 6;
+
+    PoseClassifier()
+    : poseCount(0)
+    {
+    }
+
+    bool trained() const {
+        return poseCount > 0;
+    }
+
+    myo::Pose::Type classify(const EmgFeatures& x) const {
+        int best = 0;
+        float bestScore = 0;
+        for (int k = 0; k < poseCount; k++) {
+            float score = bias[k];
+            for (int c = 0; c < emgChannels; c++) {
+                score += weights[k][c] * x.values[c];
+            }
+            if (k == 0 || score > bestScore) {
+                best = k;
+                bestScore = score;
+            }
+        }
+        return poseCount > 0 ? labels[best] : myo::Pose::unknown;
+    }
+
+    // Fit the model to the recorded examples. Every label that appears becomes one class.
+    void train(const std::vector<EmgExample>& examples) {
+        int count[maxPoses];
+        double mean[maxPoses][emgChannels];
+        poseCount = 0;
+
+        for (size_t i = 0; i < examples.size(); i++) {
+            int k = indexOf(examples[i].label);
+            if (k < 0) {
+                if (poseCount == maxPoses) {
+                    throw std::runtime_error("Too many poses in calibration data");
+                }
+                k = poseCount++;
+                labels[k] = examples[i].label;
+                count[k] = 0;
+                for (int c = 0; c < emgChannels; c++) {
+                    mean[k][c] = 0;
+                }
+            }
+            count[k]++;
+            for (int c = 0; c < emgChannels; c++) {
+                mean[k][c] += examples[i].features.values[c];
+            }
+        }
+        if (poseCount < 2) {
+            poseCount = 0;
+            throw std::runtime_error("Calibration needs examples of at least two poses");
+        }
+        for (int k = 0; k < poseCount; k++) {
+            for (int c = 0; c < emgChannels; c++) {
+                mean[k][c] /= count[k];
+            }
+        }
+
+        // Pooled within-class covariance, with a small ridge so a dead channel can't make it singular.
+        double cov[emgChannels][emgChannels] = {};
+        for (size_t i = 0; i < examples.size(); i++) {
+            int k = indexOf(examples[i].label);
+            for (int a = 0; a < emgChannels; a++) {
+                double da = examples[i].features.values[a] - mean[k][a];
+                for (int b = 0; b < emgChannels; b++) {
+                    cov[a][b] += da * (examples[i].features.values[b] - mean[k][b]);
+                }
+            }
+        }
+        double dof = examples.size() > (size_t) poseCount ? (double) (examples.size() - poseCount) : 1.0;
+        for (int a = 0; a < emgChannels; a++) {
+            for (int b = 0; b < emgChannels; b++) {
+                cov[a][b] /= dof;
+            }
+            cov[a][a] += 1e-4;
+        }
+
+        double inverse[emgChannels][emgChannels];
+        invert(cov, inverse);
+
+        for (int k = 0; k < poseCount; k++) {
+            double b = std::log((double) count[k] / examples.size());
+            for (int a = 0; a < emgChannels; a++) {
+                double w = 0;
+                for (int c = 0; c < emgChannels; c++) {
+                    w += inverse[a][c] * mean[k][c];
+                }
+                weights[k][a] = (float) w;
+                b -= 0.5 * w * mean[k][a];
+            }
+            bias[k] = (float) b;
+        }
+    }
+
+    // One model in a pose model file: its size, then a line per pose of label, bias and weights.
+    void write(std::ostream& out) const {
+        out << poseCount << " " << emgChannels << "\n";
+        out.precision(9);
+        for (int k = 0; k < poseCount; k++) {
+            out << (int) labels[k] << " " << bias[k];
+            for (int c = 0; c < emgChannels; c++) {
+                out << " " << weights[k][c];
+            }
+            out << "\n";
+        }
+    }
+
+    // Reads what write() wrote; `path` is for the errors.
+    void read(std::istream& in, const std::string& path) {
+        int poses = 0, channels = 0;
+        in >> poses >> channels;
+        if (!in || channels != emgChannels || poses < 2 || poses > maxPoses) {
+            throw std::runtime_error("Invalid pose model " + path);
+        }
+        for (int k = 0; k < poses; k++) {
+            int label = 0;
+            in >> label >> bias[k];
+            // Labels index PoseSet bits, so anything but a real pose means the file isn't one of ours.
+            if (in && (label < myo::Pose::rest || label >= maxPoses)) {
+                throw std::runtime_error("Invalid pose label in pose model " + path);
+            }
+            labels[k] = (myo::Pose::Type) label;
+            for (int c = 0; c < emgChannels; c++) {
+                in >> weights[k][c];
+            }
+        }
+        if (!in) {
+            throw std::runtime_error("Truncated pose model " + path);
+        }
+        poseCount = poses;
+    }
+
+private:
+    int indexOf(myo::Pose::Type label) const {
+        for (int k = 0; k < poseCount; k++) {
+            if (labels[k] == label) {
+                return k;
+            }
+        }
+        return -1;
+    }
+
+    // Gauss-Jordan elimination with partial pivoting.
+    static void invert(double m[emgChannels][emgChannels], double out[emgChannels][emgChannels]) {
+        for (int a = 0; a < emgChannels; a++) {
+            for (int b = 0; b < emgChannels; b++) {
+                out[a][b] = a == b ? 1.0 : 0.0;
+            }
+        }
+        for (int col = 0; col < emgChannels; col++) {
+            int pivot = col;
+            for (int row = col + 1; row < emgChannels; row++) {
+                if (std::fabs(m[row][col]) > std::fabs(m[pivot][col])) {
+                    pivot = row;
+                }
+            }
+            if (std::fabs(m[pivot][col]) < 1e-12) {
+                throw std::runtime_error("EMG covariance is singular; record more calibration data");
+            }
+            for (int c = 0; c < emgChannels; c++) {
+                std::swap(m[col][c], m[pivot][c]);
+                std::swap(out[col][c], out[pivot][c]);
+            }
+            double scale = 1.0 / m[col][col];
+            for (int c = 0; c < emgChannels; c++) {
+                m[col][c] *= scale;
+                out[col][c] *= scale;
+            }
+            for (int row = 0; row < emgChannels; row++) {
+                if (row != col && m[row][col] != 0) {
+                    double f = m[row][col];
+                    for (int c = 0; c < emgChannels; c++) {
+                        m[row][c] -= f * m[col][c];
+                        out[row][c] -= f * out[col][c];
+                    }
+                }
+            }
+        }
+    }
+
+    int poseCount;
+    myo::Pose::Type labels[maxPoses];
+    float weights[maxPoses][emgChannels];
+    float bias[maxPoses];
+};
+
+// Per-device classification state: the EMG window, this armband's own calibration examples and model
+// (no two forearms, or two placements of a band, give the same EMG for a pose), plus a small debounce so a
+// single noisy window doesn't flip the pose. Also keeps the numbers for comparing against the firmware pose
+// latency.
+class PoseTracker {
+public:
+    // Consecutive windows that must agree before the tracked pose changes (15 ms at 200 Hz).
+    static const int debounce = 3;
+
+    PoseTracker()
+    : tick(0), pose(myo::Pose::rest), candidate(myo::Pose::rest), streak(0), changedAt(0),
+      classifyCount(0), classifyNanos(0), leadCount(0), leadMicros(0)
+    {
+    }
+
+    // Calibration: feed one EMG sample, recording every 4th full window as an example of `label`;
+    // neighbouring windows overlap almost entirely.
+    void record(myo::Pose::Type label, const int8_t* emg) {
+        window.push(emg);
+        if (window.full() && ++tick % 4 == 0) {
+            EmgExample example;
+            example.label = label;
+            window.features(example.features);
+            examples.push_back(example);
+        }
+    }
+
+    // Feed one EMG sample. Returns true when the debounced pose changed.
+    bool onEmg(uint64_t timestamp, const int8_t* emg) {
+        window.push(emg);
+        if (!window.full() || !model.trained()) {
+            return false;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        EmgFeatures x;
+        window.features(x);
+        myo::Pose::Type p = model.classify(x);
+        classifyCount++;
+        classifyNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        if (p != candidate) {
+            candidate = p;
+            streak = 0;
+        }
+        if (p != pose && ++streak >= debounce) {
+            pose = p;
+            changedAt = timestamp;
+            return true;
+        }
+        return false;
+    }
+
+    // Called when the firmware reports a pose; records how far ahead of it our classifier was.
+    void onFirmwarePose(uint64_t timestamp, myo::Pose::Type firmware) {
+        if (firmware == pose && changedAt != 0 && timestamp >= changedAt && timestamp - changedAt < 1000000) {
+            leadCount++;
+            leadMicros += timestamp - changedAt;
+        }
+    }
+
+    EmgWindow window;
+    std::vector<EmgExample> examples;
+    unsigned int tick;
+    PoseClassifier model;
+    myo::Pose::Type pose;
+    myo::Pose::Type candidate;
+    int streak;
+    uint64_t changedAt;
+
+    uint64_t classifyCount, classifyNanos;
+    uint64_t leadCount, leadMicros;
+};
+
+// A pose model file holds a model per armband, in the order the armbands were first seen.
+inline void savePoseModels(const std::string& path, const std::vector<PoseClassifier>& models) {
+    std::ofstream out(path.c_str());
+    if (!out) {
+        throw std::runtime_error("Unable to write pose model " + path);
+    }
+    out << "finger-pose-model 2\n" << models.size() << "\n";
+    for (size_t i = 0; i < models.size(); i++) {
+        models[i].write(out);
+    }
+}
+
+inline void loadPoseModels(const std::string& path, std::vector<PoseClassifier>& models) {
+    std::ifstream in(path.c_str());
+    std::string magic;
+    int version = 0, count = 0;
+    in >> magic >> version >> count;
+    if (!in || magic != "finger-pose-model" || version != 2 || count < 1) {
+        throw std::runtime_error("Invalid pose model " + path);
+    }
+    models.assign(count, PoseClassifier());
+    for (int i = 0; i < count; i++) {
+        models[i].read(in, path);
+    }
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef FINGER_POSE_STATE_H
+#define FINGER_POSE_STATE_H
+
+#include <stdint.h>
+#include <myo/myo.hpp>
+
+// Set of active poses, one bit per myo::Pose::Type. Pose::unknown has no bit.
+class PoseSet {
+public:
+    PoseSet()
+    : bits(0)
+    {
+    }
+
+    static uint8_t bit(myo::Pose::Type type) {
+        return type >= myo::Pose::rest && type <= myo::Pose::doubleTap ? (uint8_t) (1u << type) : 0;
+    }
+
+    bool has(myo::Pose::Type type) const {
+        return (bits & bit(type)) != 0;
+    }
+
+    uint8_t bits;
+};
+
+// A pose starting or stopping on one armband.
+struct PoseEvent {
+    int device;
+    myo::Pose::Type pose;
+    bool on;
+    uint64_t timestamp;
+};
+
+// Active poses per armband plus a fixed queue of edge-triggered transitions (fist on, fist off, ...).
+// Everything is preallocated, so updating and polling never touch the heap.
+class PoseState {
+public:
+    static const int maxDevices = 4;
+    static const int queueSize = 32;
+
+    PoseState()
+    : dropped(0), head(0), count(0)
+    {
+    }
+
+    // Replace the active poses of a device with a single pose, queueing an event for every bit that changed.
+    void set(int device, myo::Pose::Type pose, uint64_t timestamp) {
+        if (device < 0 || device >= maxDevices) {
+            return;
+        }
+        uint8_t before = devices[device].bits;
+        uint8_t after = PoseSet::bit(pose);
+        uint8_t changed = before ^ after;
+        for (int t = myo::Pose::rest; changed != 0; t++) {
+            uint8_t b = (uint8_t) (1u << t);
+            if (changed & b) {
+                push(device, (myo::Pose::Type) t, (after & b) != 0, timestamp);
+                changed &= ~b;
+            }
+        }
+        devices[device].bits = after;
+    }
+
+    // Pops the oldest transition. Returns false when there is nothing pending.
+    bool poll(PoseEvent& event) {
+        if (count == 0) {
+            return false;
+        }
+        event = events[head];
+        head = (head + 1) % queueSize;
+        count--;
+        return true;
+    }
+
+    bool active(int device, myo::Pose::Type pose) const {
+        return device >= 0 && device < maxDevices && devices[device].has(pose);
+    }
+
+    // True if any armband currently holds the pose.
+    bool any(myo::Pose::Type pose) const {
+        uint8_t b = PoseSet::bit(pose);
+        uint8_t all = 0;
+        for (int d = 0; d < maxDevices; d++) {
+            all |= devices[d].bits;
+        }
+        return (all & b) != 0;
+    }
+
+    // Events lost because nobody polled the queue.
+    unsigned int dropped;
+
+private:
+    void push(int device, myo::Pose::Type pose, bool on, uint64_t timestamp) {
+        if (count == queueSize) {
+            dropped++;
+            return;
+        }
+        PoseEvent& e = events[(head + count) % queueSize];
+        e.device = device;
+        e.pose = pose;
+        e.on = on;
+        e.timestamp = timestamp;
+        count++;
+    }
+
+    PoseSet devices[maxDevices];
+    PoseEvent events[queueSize];
+    int head;
+    int count;
+};
+
+#endif
@@ -0,0 +1,273 @@
+#ifndef FINGER_REALTIME_H
+#define FINGER_REALTIME_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <execinfo.h>
+
+// Keeps the hooks out of their callers, so the stacks they record start at a known depth.
+#define FINGER_NOINLINE __attribute__((noinline))
+
+// Debug checks that the audio thread stays real-time safe: while a RealtimeScope is open on a thread (the
+// mixer opens one for each block it renders), heap allocations, frees and CheckedMutex locks on that thread
+// are counted and the first few call stacks are kept for report(). Anything the audio thread waits on can
+// make it miss its deadline, however rarely.
+//
+// Allocations are caught by replacing the global operator new and delete, every variant the compiler
+// offers (sized and aligned ones too, under C++14 and C++17), which has to be done in exactly one source
+// file: define FINGER_REALTIME_HOOKS before including this there. Without it, or until enable() is called,
+// the checks do nothing; enabled, they cost a thread-local test per allocation.
+//
+// Locks are only seen when they are a CheckedMutex. Nothing shared with the audio thread takes one today:
+// the handoffs are SpscRings and atomics. A lock taken inside library code (SFML's stream thread, OpenAL,
+// ALSA, the C library's malloc) goes undetected, as does a plain std::mutex.
+class RealtimeChecks {
+public:
+    enum Kind { allocation, deallocation, lock, kinds };
+
+    static const int maxReports = 16;
+    static const int stackDepth = 12;
+
+    static void enable() {
+        State& s = state();
+        // backtrace() loads its unwinder on first use, which allocates; get that over with now.
+        void* stack[stackDepth];
+        backtrace(stack, stackDepth);
+        s.enabled.store(true);
+    }
+
+    static bool enabled() {
+        return state().enabled.load(std::memory_order_relaxed);
+    }
+
+    // Notes an event if the calling thread is inside a RealtimeScope.
+    FINGER_NOINLINE static void record(Kind kind) {
+        int& depth = scopeDepth();
+        if (depth <= 0 || !enabled()) {
+            return;
+        }
+        State& s = state();
+        s.counts[kind].fetch_add(1, std::memory_order_relaxed);
+        int slot = s.reported.fetch_add(1);
+        if (slot < maxReports) {
+            // backtrace() mustn't count itself if it allocates.
+            depth = -depth;
+            Report& r = s.reports[slot];
+            r.kind = kind;
+            r.frames = backtrace(r.stack, stackDepth);
+            depth = -depth;
+            r.ready.store(true, std::memory_order_release);
+        }
+    }
+
+    static uint64_t count(Kind kind) {
+        return state().counts[kind].load(std::memory_order_relaxed);
+    }
+
+    static uint64_t total() {
+        return count(allocation) + count(deallocation) + count(lock);
+    }
+
+    // Prints the counts and the stacks recorded since the last report, headed with what the scopes were.
+    // Allocates; not for the audio thread. Stack frames are named from the dynamic symbol table where there
+    // is one (link with -rdynamic on Linux); otherwise look the addresses up with atos or addr2line.
+    static void report(std::ostream& out, const char* scopes = "Audio thread") {
+        State& s = state();
+        static const char* names[] = { "allocations", "frees", "lock acquisitions" };
+        out << scopes << ": " << count(allocation) << " " << names[allocation] << ", " << count(deallocation)
+            << " " << names[deallocation] << ", " << count(lock) << " " << names[lock] << std::endl;
+        int available = s.reported.load();
+        available = available < maxReports ? available : maxReports;
+        for (; s.printed < available; s.printed++) {
+            Report& r = s.reports[s.printed];
+            if (!r.ready.load(std::memory_order_acquire)) {
+                break;
+            }
+            out << "  " << names[r.kind] << " at:" << std::endl;
+            char** symbols = backtrace_symbols(r.stack, r.frames);
+            // The first two frames are record() and the hook that called it.
+            for (int i = 2; i < r.frames; i++) {
+                out << "    " << (symbols ? symbols[i] : "?") << std::endl;
+            }
+            free(symbols);
+        }
+    }
+
+private:
+    friend class RealtimeScope;
+
+    struct Report {
+        std::atomic<bool> ready;
+        int kind;
+        int frames;
+        void* stack[stackDepth];
+    };
+
+    struct State {
+        std::atomic<bool> enabled;
+        std::atomic<uint64_t> counts[kinds];
+        std::atomic<int> reported;
+        int printed;
+        Report reports[maxReports];
+    };
+
+    static State& state() {
+        // Zero-initialised, so there is no guard to take on first use.
+        static State s;
+        return s;
+    }
+
+    // Nesting depth of RealtimeScopes on this thread; negative while record() is busy.
+    static int& scopeDepth() {
+        static thread_local int depth = 0;
+        return depth;
+    }
+};
+
+// Marks the calling thread as real-time for its lifetime.
+class RealtimeScope {
+public:
+    RealtimeScope() {
+        RealtimeChecks::scopeDepth()++;
+    }
+
+    ~RealtimeScope() {
+        RealtimeChecks::scopeDepth()--;
+    }
+
+private:
+    RealtimeScope(const RealtimeScope&);
+    RealtimeScope& operator=(const RealtimeScope&);
+};
+
+// std::mutex that counts as a violation when locked inside a RealtimeScope. Use it for anything shared with
+// the audio thread, so a lock that creeps into the render path shows up in the checks.
+class CheckedMutex {
+public:
+    FINGER_NOINLINE void lock() {
+        RealtimeChecks::record(RealtimeChecks::lock);
+        mutex.lock();
+    }
+
+    FINGER_NOINLINE bool try_lock() {
+        RealtimeChecks::record(RealtimeChecks::lock);
+        return mutex.try_lock();
+    }
+
+    void unlock() {
+        mutex.unlock();
+    }
+
+private:
+    std::mutex mutex;
+};
+
+#ifdef FINGER_REALTIME_HOOKS
+FINGER_NOINLINE void* operator new(size_t size) {
+    RealtimeChecks::record(RealtimeChecks::allocation);
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+FINGER_NOINLINE void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    RealtimeChecks::record(RealtimeChecks::allocation);
+    return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+FINGER_NOINLINE void operator delete(void* p) noexcept {
+    if (p) {
+        RealtimeChecks::record(RealtimeChecks::deallocation);
+        free(p);
+    }
+}
+
+void operator delete[](void* p) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    operator delete(p);
+}
+#endif
+
+#ifdef __cpp_aligned_new
+// Over-aligned types; without these the library's own versions would allocate behind our back.
+FINGER_NOINLINE void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    RealtimeChecks::record(RealtimeChecks::allocation);
+    size_t alignment = (size_t) align < sizeof(void*) ? sizeof(void*) : (size_t) align;
+    void* p = NULL;
+    return posix_memalign(&p, alignment, size ? size : 1) == 0 ? p : NULL;
+}
+
+FINGER_NOINLINE void* operator new(size_t size, std::align_val_t align) {
+    void* p = operator new(size, align, std::nothrow);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return operator new(size, align, std::nothrow);
+}
+
+// posix_memalign() memory goes back with free(), like the rest.
+void operator delete(void* p, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    operator delete(p);
+}
+#endif
+#endif
+
+#endif
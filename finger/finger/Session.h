@@ -0,0 +1,231 @@
+#ifndef FINGER_SESSION_H
+#define FINGER_SESSION_H
+
+#include <stdint.h>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <SFML/Audio.hpp>
+#include "LeapIngest.h"
+#include "Mixer.h"
+#include "Performance.h"
+
+// A session is everything the detection stage saw while playing, one line per input in the order it was
+// used, so it can be run through the same pipeline again without the Myo, the Leap or an audio device:
+//
+//   finger-session 1
+//   latency <note latency, us>
+//   begin <host us> <pitch>
+//   leap <id> <timestamp> <leap now> <host now> <has hand> <palm x y z vx vy vz grab>
+//        <extended> <tip distance x5> <pinch> <grab>
+//   arm <host us> <pitch> <fist> <pitch changed at>
+//   remote <host us> <play at, host us> <note> <velocity> <off>
+//
+// A remote entry is a command put on the mixer's remote queue at that host time, the way a jam session
+// queues a peer's note; a play-at time of 0 means as soon as the mixer takes it. The recorder doesn't write
+// these, since they come in on the jam thread, but check sessions use them to cover remote playback.
+class SessionRecorder {
+public:
+    void open(const std::string& path, int64_t noteLatency) {
+        out.open(path.c_str());
+        if (!out) {
+            throw std::runtime_error("Unable to write session " + path);
+        }
+        out << "finger-session 1\nlatency " << noteLatency << "\n";
+        out.precision(9);
+    }
+
+    bool isOpen() const {
+        return out.is_open();
+    }
+
+    void begin(int64_t host, float pitch) {
+        out << "begin " << host << " " << pitch << "\n";
+    }
+
+    void leap(const LeapFrameRecord& r) {
+        const PalmSample& p = r.palm;
+        const HandFeatures& f = r.features;
+        out << "leap " << r.id << " " << r.timestamp << " " << r.leapNow << " " << r.hostNow << " " << r.hasHand;
+        if (r.hasHand) {
+            out << " " << p.x << " " << p.y << " " << p.z << " " << p.vx << " " << p.vy << " " << p.vz << " "
+                << p.grab << " " << (int) f.extended;
+            for (int i = 0; i < 5; i++) {
+                out << " " << f.tipDistance[i];
+            }
+            out << " " << f.pinch << " " << f.grab;
+        }
+        out << "\n";
+    }
+
+    void arm(const ArmState& a) {
+        out << "arm " << a.host << " " << a.pitch << " " << a.fist << " " << a.pitchChangedAt << "\n";
+        // Once per loop iteration, so a session stopped with ^C is complete up to the last strum.
+        out.flush();
+    }
+
+private:
+    std::ofstream out;
+};
+
+// drainLeapFrames(), also writing each frame to the session.
+inline int drainLeapFrames(LeapFrameQueue& queue, SensorFusion& fusion, SessionRecorder& recorder) {
+    int n = 0;
+    LeapFrameRecord record;
+    while (queue.pop(record)) {
+        applyLeapFrame(record, fusion);
+        recorder.leap(record);
+        n++;
+    }
+    return n;
+}
+
+// Live, the mixer had played up to host time `host` by the time the loop got there.
+inline void renderUntil(Mixer& mixer, int64_t host, std::vector<sf::Int16>& samples) {
+    int64_t until = mixer.frameAt(host);
+    if (until > (int64_t) mixer.position()) {
+        int frames = (int) (until - mixer.position());
+        size_t at = samples.size();
+        samples.resize(at + frames * mixerChannels);
+        mixer.render(&samples[at], frames);
+    }
+}
+
+struct SessionRender {
+    // Interleaved at mixerSampleRate and mixerChannels.
+    std::vector<sf::Int16> samples;
+    int notes;
+    MixerStats stats;
+    double seconds;
+};
+
+// Runs a recorded session through fusion, Performance and Mixer as fast as the CPU allows. The mixer's
+// timeline is pinned to the session's begin time, so every note lands on the same frame as it did live
+// and the output is identical from run to run, whatever the block size.
+inline void renderSession(const std::string& path, const NoteBank& bank, const MixerConfig& config,
+                          SessionRender& result) {
+    // Long enough for the last notes to ring out.
+    const int tailFrames = mixerSampleRate;
+
+    std::ifstream in(path.c_str());
+    std::string magic;
+    int version = 0;
+    in >> magic >> version;
+    if (!in || magic != "finger-session" || version != 1) {
+        throw std::runtime_error("Invalid session " + path);
+    }
+
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    SensorFusion fusion;
+    Performance performance(0);
+    Mixer mixer(bank, config);
+    result.samples.clear();
+    result.notes = 0;
+
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+        if (kind == "latency") {
+            fields >> performance.noteLatency;
+        } else if (kind == "begin") {
+            int64_t host = 0;
+            float pitch = 0;
+            fields >> host >> pitch;
+            mixer.startTimeline(host);
+            performance.begin(pitch);
+        } else if (kind == "leap") {
+            LeapFrameRecord r;
+            PalmSample& p = r.palm;
+            HandFeatures& f = r.features;
+            fields >> r.id >> r.timestamp >> r.leapNow >> r.hostNow >> r.hasHand;
+            if (r.hasHand) {
+                int extended = 0;
+                fields >> p.x >> p.y >> p.z >> p.vx >> p.vy >> p.vz >> p.grab >> extended;
+                for (int i = 0; i < 5; i++) {
+                    fields >> f.tipDistance[i];
+                }
+                fields >> f.pinch >> f.grab;
+                f.extended = (uint8_t) extended;
+            }
+            applyLeapFrame(r, fusion);
+        } else if (kind == "arm") {
+            ArmState a;
+            fields >> a.host >> a.pitch >> a.fist >> a.pitchChangedAt;
+            renderUntil(mixer, a.host, result.samples);
+            result.notes += performance.update(a, fusion, mixer);
+        } else if (kind == "remote") {
+            int64_t host = 0;
+            NoteCommand command = { 0, 0, 0, 0, false };
+            fields >> host >> command.time >> command.note >> command.velocity >> command.off;
+            renderUntil(mixer, host, result.samples);
+            if (!mixer.remoteNote(command)) {
+                throw std::runtime_error("Mixer's remote queue is full in " + path);
+            }
+            // Nothing here waits on what became of it.
+            RemoteOnset onset;
+            while (mixer.pollRemoteOnset(onset)) {
+            }
+        } else if (!kind.empty()) {
+            throw std::runtime_error("Unknown session entry " + kind + " in " + path);
+        }
+        if (!fields) {
+            throw std::runtime_error("Truncated session entry in " + path + ": " + line);
+        }
+    }
+
+    size_t at = result.samples.size();
+    result.samples.resize(at + tailFrames * mixerChannels);
+    mixer.render(&result.samples[at], tailFrames);
+
+    result.stats = mixer.stats();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+inline void writeWav(const std::string& path, const std::vector<sf::Int16>& samples) {
+    sf::OutputSoundFile file;
+    if (!file.openFromFile(path, mixerSampleRate, mixerChannels)) {
+        throw std::runtime_error("Unable to write " + path);
+    }
+    file.write(samples.empty() ? 0 : &samples[0], samples.size());
+}
+
+// Compares a render against a golden WAV. Returns the largest difference in any sample (32768 if the
+// lengths or formats differ) and the first frame that differs by more than tolerance, or -1.
+inline int compareWav(const std::string& path, const std::vector<sf::Int16>& samples, int tolerance,
+                      int64_t& firstFrame) {
+    sf::InputSoundFile file;
+    if (!file.openFromFile(path)) {
+        throw std::runtime_error("Unable to read " + path);
+    }
+    firstFrame = -1;
+    if (file.getChannelCount() != mixerChannels || file.getSampleRate() != mixerSampleRate
+        || file.getSampleCount() != samples.size()) {
+        firstFrame = 0;
+        return 32768;
+    }
+
+    int worst = 0;
+    sf::Int16 chunk[4096];
+    size_t at = 0;
+    while (sf::Uint64 n = file.read(chunk, 4096)) {
+        for (sf::Uint64 i = 0; i < n; i++, at++) {
+            int diff = std::abs(chunk[i] - samples[at]);
+            if (diff > tolerance && firstFrame < 0) {
+                firstFrame = (int64_t) (at / mixerChannels);
+            }
+            if (diff > worst) {
+                worst = diff;
+            }
+        }
+    }
+    return worst;
+}
+
+#endif
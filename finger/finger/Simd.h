@@ -0,0 +1,11 @@
+#ifndef FINGER_SIMD_H
+#define FINGER_SIMD_H
+
+// SSE is always there on x86-64; elsewhere the plain loops next to each SSE one are used, and give the same
+// results.
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define FINGER_SSE 1
+#endif
+
+#endif
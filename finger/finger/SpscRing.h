@@ -0,0 +1,55 @@
+#ifndef FINGER_SPSC_RING_H
+#define FINGER_SPSC_RING_H
+
+#include <atomic>
+
+// Lock-free single-producer/single-consumer queue of N slots (N must be a power of two).
+// One thread may call push() and one other thread may call pop(); neither ever blocks or allocates.
+template <typename T, unsigned int N>
+class SpscRing {
+public:
+    SpscRing()
+    : head(0), tail(0), dropped(0)
+    {
+        static_assert((N & (N - 1)) == 0, "SpscRing size must be a power of two");
+    }
+
+    // Producer side. Returns false, and counts the item as dropped, when the queue is full.
+    bool push(const T& item) {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        slots[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false when the queue is empty.
+    bool pop(T& item) {
+        unsigned int h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = slots[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    unsigned int droppedCount() const {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    T slots[N];
+    std::atomic<unsigned int> head;
+    std::atomic<unsigned int> tail;
+    std::atomic<unsigned int> dropped;
+};
+
+#endif
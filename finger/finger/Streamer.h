@@ -0,0 +1,203 @@
+#ifndef FINGER_STREAMER_H
+#define FINGER_STREAMER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <SFML/Audio.hpp>
+#include "NoteBank.h"
+#include "SpscRing.h"
+
+// Plays the part of each take that isn't resident in the NoteBank. A voice starts on the resident head;
+// meanwhile a prefetch thread opens the take's file, seeks past the head and keeps a per-voice ring topped
+// up, and once the head runs out the mixer carries on from the ring.
+//
+// The mixer side never blocks, locks or allocates: starting a stream is a push onto a lock-free queue, and
+// reading one only looks at the ring's atomic positions. If the ring is empty when the voice needs it (the
+// disk fell behind) the voice is silent for those frames and picks up where it left off.
+class SampleStreamer {
+public:
+    // Per-voice ring, ~190 ms at 44.1 kHz. The head needs to cover the time to open a file and fill the
+    // first chunk.
+    static const int ringFrames = 8192;
+    static const int chunkFrames = 2048;
+
+    SampleStreamer(const NoteBank& bank, int voices)
+    : starvedFrames(0), bank(bank), voices(voices), active(false), rings(new Ring[voices]),
+      streams(new Stream[voices])
+    {
+        for (int v = 0; v < voices; v++) {
+            rings[v].ticket.store(0);
+            rings[v].filled.store(0);
+            rings[v].read.store(0);
+            rings[v].written.store(0);
+            rings[v].end.store(0);
+            streams[v].ticket = 0;
+            streams[v].remaining = 0;
+        }
+    }
+
+    ~SampleStreamer() {
+        stop();
+        delete[] rings;
+        delete[] streams;
+    }
+
+    void start() {
+        if (!active) {
+            active = true;
+            thread = std::thread(&SampleStreamer::run, this);
+        }
+    }
+
+    void stop() {
+        if (active) {
+            active = false;
+            thread.join();
+        }
+    }
+
+    bool running() const {
+        return active;
+    }
+
+    // Mixer thread: voice `voice` has just started `sample` from frame 0. Returns the ticket that read()
+    // needs to check the ring holds this take and not a previous one, or 0 if the request queue is full and
+    // the voice will have to stop at the end of the head.
+    uint32_t begin(int voice, const NoteSample& sample) {
+        Ring& ring = rings[voice];
+        uint32_t ticket = ring.ticket.load(std::memory_order_relaxed) + 1;
+        ticket = ticket == 0 ? 1 : ticket;
+        ring.ticket.store(ticket, std::memory_order_release);
+        Request request = { voice, sample.index, ticket, sample.resident, sample.frames - sample.resident };
+        return requests.push(request) ? ticket : 0;
+    }
+
+    // Mixer thread: adds up to `frames` frames of the voice's stream into interleaved mix, frame i scaled by
+    // base + slope * (step + i). Returns how many frames were mixed; `done` is set once the whole stream has
+    // been played (or the file couldn't be read).
+    int read(int voice, uint32_t ticket, float* mix, int frames, float base, float slope, int step, bool& done) {
+        Ring& ring = rings[voice];
+        done = ticket == 0;
+        if (done || ring.filled.load(std::memory_order_acquire) != ticket) {
+            return 0;
+        }
+        uint64_t r = ring.read.load(std::memory_order_relaxed);
+        uint64_t available = ring.written.load(std::memory_order_acquire) - r;
+        int n = available < (uint64_t) frames ? (int) available : frames;
+        done = r + n >= ring.end.load(std::memory_order_relaxed);
+        for (int i = 0; i < n; i++) {
+            const sf::Int16* in = &ring.data[((r + i) & (ringFrames - 1)) * mixerChannels];
+            float gain = base + slope * (step + i);
+            for (unsigned int c = 0; c < mixerChannels; c++) {
+                mix[i * mixerChannels + c] += in[c] * gain;
+            }
+        }
+        ring.read.store(r + n, std::memory_order_release);
+        return n;
+    }
+
+    // Frames voices spent waiting on an empty ring. Written by the mixer thread.
+    std::atomic<uint64_t> starvedFrames;
+
+private:
+    struct Request {
+        int voice;
+        uint32_t sample;
+        uint32_t ticket;
+        size_t from;
+        size_t frames;
+    };
+
+    struct Ring {
+        // Latest take started on the voice (written by the mixer), and the one the ring currently holds
+        // (written by the prefetch thread once it has reset the positions for it).
+        std::atomic<uint32_t> ticket;
+        std::atomic<uint32_t> filled;
+        std::atomic<uint64_t> read;
+        std::atomic<uint64_t> written;
+        // Frames the stream will deliver in total.
+        std::atomic<uint64_t> end;
+        sf::Int16 data[ringFrames * mixerChannels];
+    };
+
+    // Prefetch thread's side of a voice.
+    struct Stream {
+        sf::InputSoundFile file;
+        uint32_t ticket;
+        size_t remaining;
+    };
+
+    SampleStreamer(const SampleStreamer&);
+    SampleStreamer& operator=(const SampleStreamer&);
+
+    void run() {
+        while (active) {
+            Request request;
+            while (requests.pop(request)) {
+                open(request);
+            }
+            bool busy = false;
+            for (int v = 0; v < voices; v++) {
+                busy = fill(v) || busy;
+            }
+            if (!busy) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    void open(const Request& request) {
+        Stream& stream = streams[request.voice];
+        Ring& ring = rings[request.voice];
+        stream.ticket = request.ticket;
+        stream.remaining = 0;
+        // The mixer has already moved on to this ticket, so it won't touch the old positions again.
+        ring.read.store(0, std::memory_order_relaxed);
+        ring.written.store(0, std::memory_order_relaxed);
+        if (request.frames > 0 && stream.file.openFromFile(bank.path(request.sample))) {
+            stream.file.seek((sf::Uint64) request.from * mixerChannels);
+            stream.remaining = request.frames;
+        }
+        ring.end.store(stream.remaining, std::memory_order_relaxed);
+        ring.filled.store(request.ticket, std::memory_order_release);
+    }
+
+    // Tops up one voice's ring by a chunk. Returns true if there was anything to do.
+    bool fill(int v) {
+        Stream& stream = streams[v];
+        Ring& ring = rings[v];
+        if (stream.remaining == 0 || ring.ticket.load(std::memory_order_acquire) != stream.ticket) {
+            return false;
+        }
+        uint64_t w = ring.written.load(std::memory_order_relaxed);
+        uint64_t space = ringFrames - (w - ring.read.load(std::memory_order_acquire));
+        size_t n = space < (uint64_t) chunkFrames ? (size_t) space : (size_t) chunkFrames;
+        n = n < stream.remaining ? n : stream.remaining;
+        // Chunks never wrap: stop at the end of the ring and do the rest next time round.
+        size_t start = (size_t) (w & (ringFrames - 1));
+        n = n < ringFrames - start ? n : ringFrames - start;
+        if (n == 0) {
+            return false;
+        }
+        size_t got = (size_t) (stream.file.read(&ring.data[start * mixerChannels], n * mixerChannels)
+                               / mixerChannels);
+        stream.remaining = got < n ? 0 : stream.remaining - got;
+        if (stream.remaining == 0) {
+            ring.end.store(w + got, std::memory_order_relaxed);
+        }
+        ring.written.store(w + got, std::memory_order_release);
+        return true;
+    }
+
+    const NoteBank& bank;
+    int voices;
+    std::atomic<bool> active;
+    SpscRing<Request, 256> requests;
+    Ring* rings;
+    Stream* streams;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef FINGER_VISUALIZER_H
+#define FINGER_VISUALIZER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <SFML/Network.hpp>
+#include "Clock.h"
+#include "Fusion.h"
+#include "SpscRing.h"
+#include "Wire.h"
+
+const unsigned short visualizerPort = 47047;
+// WireHeader kind of the visualizer stream.
+const uint16_t visualizerKind = 1;
+
+enum VisualEventType {
+    visualNoteOn = 1,
+    visualNoteOff,
+    visualStrum,
+    visualPalm,
+    visualArm
+};
+
+// Something for the visualizer to draw, stamped with the host time it happened at. What `value` holds
+// depends on the type:
+//
+//   note on:  velocity (0-1)                    note off: nothing; note -1 is every note
+//   strum:    velocity, 1 for a downstroke      palm:     x, y, z in mm, grab strength (0-1)
+//   arm:      roll, pitch, yaw on the collector's 0-18 scale; note is the armband
+struct VisualEvent {
+    uint8_t type;
+    int16_t note;
+    int64_t time;
+    float value[4];
+};
+
+struct VisualizerStats {
+    uint64_t datagrams;
+    uint64_t events;
+    uint64_t bytes;
+    // Events that didn't fit in the queue, and datagrams the socket refused.
+    uint64_t dropped;
+    uint64_t errors;
+};
+
+// Streams VisualEvents to the Oculus visualizer over UDP. The play loop only posts events onto a lock-free
+// queue; a network thread wakes once per display frame, packs everything queued into as few datagrams as
+// it fits in and sends them. Each datagram carries a sequence number, so the other end can tell how many
+// were lost, and the time it was sent.
+//
+// Datagrams are a WireHeader and a WireEvent per event (see Wire.h), built in one buffer that is reused for
+// every datagram.
+class VisualizerStream {
+public:
+    VisualizerStream()
+    : port(0), frameMicros(11111), running(false), sequence(0), lastPalm(0), datagrams(0), events(0),
+      bytes(0), errors(0)
+    {
+    }
+
+    ~VisualizerStream() {
+        stop();
+    }
+
+    // Where to send, and how often: one batch per display frame (90 Hz by default).
+    void open(const sf::IpAddress& host, unsigned short port, int64_t frameMicros = 11111) {
+        if (host == sf::IpAddress::None) {
+            throw std::runtime_error("Unknown visualizer host");
+        }
+        this->host = host;
+        this->port = port;
+        this->frameMicros = frameMicros;
+    }
+
+    void start() {
+        if (!running && port != 0) {
+            running = true;
+            thread = std::thread(&VisualizerStream::run, this);
+        }
+    }
+
+    void stop() {
+        if (running) {
+            running = false;
+            thread.join();
+        }
+    }
+
+    bool isOpen() const {
+        return port != 0;
+    }
+
+    // Play loop thread only. Returns false if the queue is full and the event was dropped.
+    bool post(const VisualEvent& event) {
+        return queue.push(event);
+    }
+
+    bool post(VisualEventType type, int note, int64_t time, float a = 0, float b = 0, float c = 0,
+              float d = 0) {
+        VisualEvent event = { (uint8_t) type, (int16_t) note, time, { a, b, c, d } };
+        return post(event);
+    }
+
+    // Play loop thread: posts the palm samples that have arrived since the last call.
+    void postPalms(const PalmBuffer& palms) {
+        int first = palms.size();
+        while (first > 0 && palms.timeAt(first - 1) > lastPalm) {
+            first--;
+        }
+        for (int i = first; i < palms.size(); i++) {
+            int s = palms.slot(i);
+            post(visualPalm, 0, palms.times[s], palms.x[s], palms.y[s], palms.z[s], palms.grab[s]);
+            lastPalm = palms.times[s];
+        }
+    }
+
+    VisualizerStats stats() const {
+        VisualizerStats s;
+        s.datagrams = datagrams.load(std::memory_order_relaxed);
+        s.events = events.load(std::memory_order_relaxed);
+        s.bytes = bytes.load(std::memory_order_relaxed);
+        s.dropped = queue.droppedCount();
+        s.errors = errors.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    void run() {
+        std::chrono::microseconds frame(frameMicros);
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+        while (running) {
+            next += frame;
+            std::this_thread::sleep_until(next);
+            flush();
+        }
+        flush();
+    }
+
+    void flush() {
+        VisualEvent e;
+        while (!queue.empty()) {
+            WireWriter writer(buffer);
+            writer.begin(wireMagic, visualizerKind, sequence++, hostMicros());
+            while (writer.size() < wireMaxEvents && queue.pop(e)) {
+                writer.add(e.type, e.note, e.time, e.value);
+            }
+            int count = writer.size();
+            size_t size = writer.finish();
+            if (socket.send(buffer, size, host, port) != sf::Socket::Done) {
+                errors.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            datagrams.fetch_add(1, std::memory_order_relaxed);
+            events.fetch_add(count, std::memory_order_relaxed);
+            bytes.fetch_add(size, std::memory_order_relaxed);
+        }
+    }
+
+    sf::IpAddress host;
+    unsigned short port;
+    int64_t frameMicros;
+    std::atomic<bool> running;
+    std::thread thread;
+    SpscRing<VisualEvent, 512> queue;
+    // Network thread only.
+    sf::UdpSocket socket;
+    uint64_t buffer[wireMaxDatagram / 8];
+    uint32_t sequence;
+    // Play loop thread only: time of the newest palm sample posted.
+    int64_t lastPalm;
+
+    std::atomic<uint64_t> datagrams;
+    std::atomic<uint64_t> events;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> errors;
+};
+
+// The other end of a VisualizerStream, for testing without the visualizer: reads datagrams as they arrive
+// and keeps track of lost and reordered ones from the sequence numbers.
+class VisualizerReceiver {
+public:
+    VisualizerReceiver()
+    : datagrams(0), events(0), malformed(0)
+    {
+    }
+
+    // Port 0 takes any free one; see port().
+    void bind(unsigned short port) {
+        if (socket.bind(port) != sf::Socket::Done) {
+            throw std::runtime_error("Unable to listen on the visualizer port");
+        }
+        socket.setBlocking(false);
+    }
+
+    unsigned short port() const {
+        return socket.getLocalPort();
+    }
+
+    // Reads one waiting datagram, whose events are then in datagram() until the next poll(). Returns the
+    // number of events, or -1 if nothing was waiting.
+    int poll() {
+        sf::IpAddress from;
+        unsigned short fromPort;
+        size_t size;
+        if (socket.receive(buffer, sizeof(buffer), size, from, fromPort) != sf::Socket::Done) {
+            return -1;
+        }
+        if (!reader.parse(buffer, size, wireMagic, visualizerKind)) {
+            malformed++;
+            return 0;
+        }
+        sequence.track(reader.sequence());
+        datagrams++;
+        events += reader.count();
+        return reader.count();
+    }
+
+    const WireReader& datagram() const {
+        return reader;
+    }
+
+    uint64_t datagrams;
+    uint64_t events;
+    uint64_t malformed;
+    WireSequence sequence;
+
+private:
+    sf::UdpSocket socket;
+    uint64_t buffer[wireMaxDatagram / 8];
+    WireReader reader;
+};
+
+// Prints what arrives on `port` until the process is stopped: notes and strums as they come, and a count
+// of everything once a second.
+inline void listenVisualizer(unsigned short port, std::ostream& out) {
+    VisualizerReceiver receiver;
+    receiver.bind(port);
+    out << "Listening for the visualizer stream on port " << receiver.port() << std::endl;
+    const WireReader& datagram = receiver.datagram();
+    int64_t nextReport = hostMicros() + 1000000;
+    for (;;) {
+        int count;
+        while ((count = receiver.poll()) >= 0) {
+            for (int i = 0; i < count; i++) {
+                const WireEvent& e = datagram.event(i);
+                if (e.type == visualNoteOn) {
+                    out << datagram.time(i) << " note on " << e.note << " velocity " << e.value[0]
+                        << std::endl;
+                } else if (e.type == visualNoteOff) {
+                    out << datagram.time(i) << " note off " << e.note << std::endl;
+                } else if (e.type == visualStrum) {
+                    out << datagram.time(i) << (e.value[1] != 0 ? " downstroke " : " upstroke ") << e.value[0]
+                        << std::endl;
+                }
+            }
+        }
+        if (hostMicros() >= nextReport) {
+            out << receiver.events << " events in " << receiver.datagrams << " datagrams, "
+                << receiver.sequence.lost << " lost, " << receiver.sequence.late << " out of order, "
+                << receiver.malformed << " malformed" << std::endl;
+            nextReport += 1000000;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Streams a few seconds of made-up play (palm and arm every frame, a six-note strum four times a second)
+// through a VisualizerStream to a VisualizerReceiver on the loopback interface, and reports what arrived
+// and how long it took from post() to being read.
+inline void loopbackVisualizerTest(std::ostream& out) {
+    VisualizerReceiver receiver;
+    receiver.bind(0);
+    VisualizerStream stream;
+    stream.open(sf::IpAddress::LocalHost, receiver.port());
+    stream.start();
+
+    const int seconds = 3;
+    const int64_t frameMicros = 11111;
+    int64_t start = hostMicros();
+    int64_t nextFrame = start;
+    int frames = 0;
+    uint64_t posted = 0;
+    int64_t delayTotal = 0;
+    int64_t delayMax = 0;
+    const WireReader& datagram = receiver.datagram();
+    for (;;) {
+        int64_t now = hostMicros();
+        if (now >= nextFrame && now < start + seconds * 1000000) {
+            stream.post(visualPalm, 0, now, 10.0f * frames, 200, -40, 0.5f);
+            stream.post(visualArm, 0, now, 9, (float) (frames % 18), 9);
+            posted += 2;
+            if (frames % 22 == 0) {
+                stream.post(visualStrum, 0, now, 0.8f, 1);
+                for (int n = 0; n < 6; n++) {
+                    stream.post(visualNoteOn, n * 4, now, 0.8f);
+                }
+                stream.post(visualNoteOff, -1, now);
+                posted += 8;
+            }
+            frames++;
+            nextFrame += frameMicros;
+        }
+        int count;
+        while ((count = receiver.poll()) >= 0) {
+            int64_t received = hostMicros();
+            for (int i = 0; i < count; i++) {
+                int64_t delay = received - datagram.time(i);
+                delayTotal += delay;
+                delayMax = delay > delayMax ? delay : delayMax;
+            }
+        }
+        if (now > start + seconds * 1000000 + 200000) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    stream.stop();
+
+    VisualizerStats sent = stream.stats();
+    out << "Visualizer loopback: " << posted << " events posted, " << sent.events << " sent in "
+        << sent.datagrams << " datagrams (" << (sent.datagrams ? sent.bytes / sent.datagrams : 0)
+        << " bytes each, " << (sent.events ? (double) sent.bytes / sent.events : 0) << " per event), "
+        << sent.dropped << " dropped, " << sent.errors << " send errors" << std::endl;
+    out << "  received " << receiver.events << " events in " << receiver.datagrams << " datagrams, "
+        << receiver.sequence.lost << " lost, " << receiver.sequence.late << " out of order, "
+        << receiver.malformed << " malformed; post to receive mean "
+        << (receiver.events ? delayTotal / (int64_t) receiver.events / 1000.0 : 0) << " ms, max "
+        << delayMax / 1000.0 << " ms" << std::endl;
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef FINGER_VOICES_H
+#define FINGER_VOICES_H
+
+#include <stdint.h>
+#include "Chords.h"
+
+// Which voice to take over when a note starts and none is free.
+enum StealPolicy {
+    // The voice that started longest ago.
+    stealOldest,
+    // The voice that is currently softest (envelope level times velocity, with a voice still in its attack
+    // counted at its peak).
+    stealQuietest,
+    // A voice already playing the same note is restarted even if others are free, like re-picking a string;
+    // otherwise the oldest.
+    stealSameNote
+};
+
+// Hands out voice slots from a fixed pool of N. Everything is kept in index-linked arrays inside the
+// allocator, so nothing is allocated after construction:
+//
+//   - a free list, so a free voice is found in O(1);
+//   - a list of busy voices in start order, so the oldest is its head;
+//   - a list of busy voices per note, for retriggering;
+//   - a binary min-heap of busy voices keyed by loudness, so the quietest is its root and a start or a
+//     steal costs O(log N).
+//
+// Loudness changes all the time, so the mixer updates the keys once per envelope step and calls reheap().
+template <int N>
+class VoiceAllocator {
+public:
+    VoiceAllocator()
+    : freeHead(0), oldest(-1), newest(-1), heapSize(0)
+    {
+        for (int v = 0; v < N; v++) {
+            nextFree[v] = v + 1 < N ? v + 1 : -1;
+            note[v] = -1;
+            heapIndex[v] = -1;
+            key[v] = 0;
+        }
+        for (int n = 0; n < noteCount; n++) {
+            noteHead[n] = -1;
+        }
+    }
+
+    // A voice for note n, which will start at `loudness`. Sets `stolen` if the voice was busy.
+    int allocate(int n, StealPolicy policy, float loudness, bool& stolen) {
+        int v = -1;
+        if (policy == stealSameNote && noteHead[n] >= 0) {
+            v = noteHead[n];
+        } else if (freeHead >= 0) {
+            v = freeHead;
+            freeHead = nextFree[v];
+        } else {
+            v = policy == stealQuietest ? heap[0] : oldest;
+        }
+
+        stolen = note[v] >= 0;
+        if (stolen) {
+            unlink(v);
+        }
+        // Newest at the tail of the age list, and at the head of its note's list.
+        note[v] = n;
+        agePrev[v] = newest;
+        ageNext[v] = -1;
+        if (newest >= 0) {
+            ageNext[newest] = v;
+        } else {
+            oldest = v;
+        }
+        newest = v;
+        notePrev[v] = -1;
+        noteNext[v] = noteHead[n];
+        if (noteHead[n] >= 0) {
+            notePrev[noteHead[n]] = v;
+        }
+        noteHead[n] = v;
+
+        key[v] = loudness;
+        if (heapIndex[v] < 0) {
+            heapIndex[v] = heapSize;
+            heap[heapSize++] = v;
+        }
+        siftUp(heapIndex[v]);
+        siftDown(heapIndex[v]);
+        return v;
+    }
+
+    // Voice v has finished and goes back on the free list.
+    void free(int v) {
+        if (note[v] < 0) {
+            return;
+        }
+        unlink(v);
+        note[v] = -1;
+        int last = heap[--heapSize];
+        int at = heapIndex[v];
+        heapIndex[v] = -1;
+        if (last != v) {
+            heap[at] = last;
+            heapIndex[last] = at;
+            siftUp(at);
+            siftDown(heapIndex[last]);
+        }
+        nextFree[v] = freeHead;
+        freeHead = v;
+    }
+
+    // New loudness for a busy voice; takes effect at the next reheap().
+    void setLoudness(int v, float loudness) {
+        key[v] = loudness;
+    }
+
+    // Restores heap order after setLoudness() calls, in O(N).
+    void reheap() {
+        for (int i = heapSize / 2 - 1; i >= 0; i--) {
+            siftDown(i);
+        }
+    }
+
+    bool busy(int v) const {
+        return note[v] >= 0;
+    }
+
+private:
+    // Takes v out of the age list and its note's list.
+    void unlink(int v) {
+        if (agePrev[v] >= 0) {
+            ageNext[agePrev[v]] = ageNext[v];
+        } else {
+            oldest = ageNext[v];
+        }
+        if (ageNext[v] >= 0) {
+            agePrev[ageNext[v]] = agePrev[v];
+        } else {
+            newest = agePrev[v];
+        }
+        if (notePrev[v] >= 0) {
+            noteNext[notePrev[v]] = noteNext[v];
+        } else {
+            noteHead[note[v]] = noteNext[v];
+        }
+        if (noteNext[v] >= 0) {
+            notePrev[noteNext[v]] = notePrev[v];
+        }
+    }
+
+    void place(int i, int v) {
+        heap[i] = v;
+        heapIndex[v] = i;
+    }
+
+    void siftUp(int i) {
+        int v = heap[i];
+        while (i > 0 && key[heap[(i - 1) / 2]] > key[v]) {
+            place(i, heap[(i - 1) / 2]);
+            i = (i - 1) / 2;
+        }
+        place(i, v);
+    }
+
+    void siftDown(int i) {
+        int v = heap[i];
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= heapSize) {
+                break;
+            }
+            if (child + 1 < heapSize && key[heap[child + 1]] < key[heap[child]]) {
+                child++;
+            }
+            if (key[heap[child]] >= key[v]) {
+                break;
+            }
+            place(i, heap[child]);
+            i = child;
+        }
+        place(i, v);
+    }
+
+    int freeHead;
+    int nextFree[N];
+    int oldest;
+    int newest;
+    int agePrev[N];
+    int ageNext[N];
+    int noteHead[noteCount];
+    int notePrev[N];
+    int noteNext[N];
+    // Note the voice is playing, or -1 if it is free.
+    int note[N];
+    int heap[N];
+    int heapIndex[N];
+    int heapSize;
+    float key[N];
+};
+
+#endif
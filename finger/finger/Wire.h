@@ -0,0 +1,285 @@
+#ifndef FINGER_WIRE_H
+#define FINGER_WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <ostream>
+#include <SFML/Network.hpp>
+
+// Layout of the datagrams the visualizer stream (and, later, other network streams) send: a header then
+// `count` fixed-size records, little-endian, with every field at its natural alignment so no compiler pads
+// or reorders anything. A sender fills a preallocated buffer field by field and hands it straight to the
+// socket; a receiver checks the header and reads the records where they landed. On a little-endian machine
+// neither side converts anything; on a big-endian one the fields are swapped in place.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define FINGER_BIG_ENDIAN
+#endif
+
+struct WireHeader {
+    uint32_t magic;
+    uint32_t sequence;
+    // Host time the datagram was sent at; record times are offsets from it.
+    int64_t sent;
+    uint16_t count;
+    uint16_t kind;
+    uint32_t reserved;
+};
+
+// One event. `offset` is its time less the header's `sent`, in microseconds.
+struct WireEvent {
+    int32_t offset;
+    float value[4];
+    int16_t note;
+    uint8_t type;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(WireHeader) == 24, "WireHeader must have no padding");
+static_assert(sizeof(WireEvent) == 24, "WireEvent must have no padding");
+
+// "FGR1", at the start of every datagram; the header's kind says which stream it belongs to.
+const uint32_t wireMagic = 0x46475231;
+
+// Largest datagram anything here sends; small enough not to be fragmented on any usual link.
+const size_t wireMaxDatagram = 1200;
+const int wireMaxEvents = (int) ((wireMaxDatagram - sizeof(WireHeader)) / sizeof(WireEvent));
+
+#ifdef FINGER_BIG_ENDIAN
+inline void wireSwap(void* p, size_t n) {
+    uint8_t* b = (uint8_t*) p;
+    for (size_t i = 0; i < n / 2; i++) {
+        uint8_t t = b[i];
+        b[i] = b[n - 1 - i];
+        b[n - 1 - i] = t;
+    }
+}
+
+inline void wireOrder(WireHeader& h) {
+    wireSwap(&h.magic, 4);
+    wireSwap(&h.sequence, 4);
+    wireSwap(&h.sent, 8);
+    wireSwap(&h.count, 2);
+    wireSwap(&h.kind, 2);
+}
+
+inline void wireOrder(WireEvent& e) {
+    wireSwap(&e.offset, 4);
+    for (int i = 0; i < 4; i++) {
+        wireSwap(&e.value[i], 4);
+    }
+    wireSwap(&e.note, 2);
+}
+#else
+// Between host and wire order; nothing to do on a little-endian host.
+inline void wireOrder(WireHeader&) {
+}
+
+inline void wireOrder(WireEvent&) {
+}
+#endif
+
+// Builds one datagram in a caller-owned buffer, which must be 8-byte aligned and wireMaxDatagram long.
+// Reusing the buffer for every datagram means sending allocates nothing.
+class WireWriter {
+public:
+    explicit WireWriter(void* buffer)
+    : header((WireHeader*) buffer), events((WireEvent*) (header + 1)), count(0)
+    {
+    }
+
+    void begin(uint32_t magic, uint16_t kind, uint32_t sequence, int64_t sent) {
+        header->magic = magic;
+        header->sequence = sequence;
+        header->sent = sent;
+        header->kind = kind;
+        header->reserved = 0;
+        count = 0;
+    }
+
+    // Returns false once the datagram is full.
+    bool add(uint8_t type, int note, int64_t time, const float* value) {
+        if (count == wireMaxEvents) {
+            return false;
+        }
+        WireEvent& e = events[count++];
+        e.offset = (int32_t) (time - header->sent);
+        for (int i = 0; i < 4; i++) {
+            e.value[i] = value[i];
+        }
+        e.note = (int16_t) note;
+        e.type = type;
+        e.reserved = 0;
+        wireOrder(e);
+        return true;
+    }
+
+    // Finishes the header; returns the number of bytes to send from the buffer.
+    size_t finish() {
+        header->count = (uint16_t) count;
+        wireOrder(*header);
+        return sizeof(WireHeader) + count * sizeof(WireEvent);
+    }
+
+    int size() const {
+        return count;
+    }
+
+private:
+    WireHeader* header;
+    WireEvent* events;
+    int count;
+};
+
+// Reads a received datagram where it lies. The buffer must be 8-byte aligned.
+class WireReader {
+public:
+    WireReader()
+    : header(NULL), events(NULL)
+    {
+    }
+
+    // Returns false, leaving nothing to read, unless `data` holds a whole datagram with this magic and kind.
+    bool parse(void* data, size_t size, uint32_t magic, uint16_t kind) {
+        header = NULL;
+        if (size < sizeof(WireHeader)) {
+            return false;
+        }
+        WireHeader* h = (WireHeader*) data;
+        wireOrder(*h);
+        if (h->magic != magic || h->kind != kind ||
+            size != sizeof(WireHeader) + h->count * sizeof(WireEvent)) {
+            return false;
+        }
+        events = (WireEvent*) (h + 1);
+        for (int i = 0; i < h->count; i++) {
+            wireOrder(events[i]);
+        }
+        header = h;
+        return true;
+    }
+
+    int count() const {
+        return header ? header->count : 0;
+    }
+
+    uint32_t sequence() const {
+        return header->sequence;
+    }
+
+    int64_t sent() const {
+        return header->sent;
+    }
+
+    const WireEvent& event(int i) const {
+        return events[i];
+    }
+
+    int64_t time(int i) const {
+        return header->sent + events[i].offset;
+    }
+
+private:
+    const WireHeader* header;
+    WireEvent* events;
+};
+
+// Keeps track of lost and reordered datagrams from the sequence numbers of one sender.
+struct WireSequence {
+    WireSequence()
+    : lost(0), late(0), started(false), expected(0)
+    {
+    }
+
+    void track(uint32_t seq) {
+        if (!started || seq - expected < 0x80000000u) {
+            lost += started ? seq - expected : 0;
+            expected = seq + 1;
+            started = true;
+        } else {
+            late++;
+            lost -= lost > 0 ? 1 : 0;
+        }
+    }
+
+    // Sequence numbers skipped over, less those that turned up later.
+    uint64_t lost;
+    uint64_t late;
+    bool started;
+    uint32_t expected;
+};
+
+// Times packing and unpacking a datagram of events two ways, through the wire structs and through
+// sf::Packet field by field as the visualizer stream used to, and prints datagrams per second and bytes per
+// event for each.
+inline void benchmarkWire(std::ostream& out) {
+    const int events = 32;
+    const int rounds = 200000;
+    float value[4] = { 10.5f, 200, -40, 0.5f };
+    int64_t base = 1000000000;
+    uint64_t check = 0;
+
+    // sf::Packet: grows its vector, swaps each field on the way in and again on the way out.
+    size_t packetBytes = 0;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        sf::Packet packet;
+        packet << (sf::Uint32) wireMagic << (sf::Uint32) r << (sf::Int64) base << (sf::Uint8) events;
+        for (int i = 0; i < events; i++) {
+            packet << (sf::Uint8) 4 << (sf::Int16) i << (sf::Int64) (base + i) << value[0] << value[1]
+                   << value[2] << value[3];
+        }
+        packetBytes = packet.getDataSize();
+        sf::Packet received;
+        received.append(packet.getData(), packet.getDataSize());
+        sf::Uint32 m, seq;
+        sf::Int64 sent;
+        sf::Uint8 count;
+        received >> m >> seq >> sent >> count;
+        for (int i = 0; i < count; i++) {
+            sf::Uint8 type;
+            sf::Int16 note;
+            sf::Int64 time;
+            float v[4];
+            received >> type >> note >> time >> v[0] >> v[1] >> v[2] >> v[3];
+            check += type + note + time;
+        }
+    }
+    double packetSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    // Wire structs: written into and read out of the same buffers every round.
+    uint64_t sendBuffer[wireMaxDatagram / 8];
+    uint64_t receiveBuffer[wireMaxDatagram / 8];
+    size_t wireBytes = 0;
+    started = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        WireWriter writer(sendBuffer);
+        writer.begin(wireMagic, 1, r, base);
+        for (int i = 0; i < events; i++) {
+            writer.add(4, i, base + i, value);
+        }
+        wireBytes = writer.finish();
+        // Stands in for the socket copying the datagram out and back in.
+        memcpy(receiveBuffer, sendBuffer, wireBytes);
+        WireReader reader;
+        reader.parse(receiveBuffer, wireBytes, wireMagic, 1);
+        for (int i = 0; i < reader.count(); i++) {
+            const WireEvent& e = reader.event(i);
+            check += e.type + e.note + reader.time(i);
+        }
+    }
+    double wireSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    // Keeps the decoding from being optimised away.
+    volatile uint64_t sink = check;
+    (void) sink;
+
+    out << "Datagrams of " << events << " events, packed and unpacked:" << std::endl;
+    out << "  sf::Packet:   " << rounds / packetSeconds << " datagrams/s, " << rounds * events / packetSeconds
+        << " events/s, " << (double) packetBytes / events << " bytes per event" << std::endl;
+    out << "  wire structs: " << rounds / wireSeconds << " datagrams/s, " << rounds * events / wireSeconds
+        << " events/s, " << (double) wireBytes / events << " bytes per event" << std::endl;
+}
+
+#endif
@@ -1,5 +1,9 @@
 #define _USE_MATH_DEFINES
+// This file provides the allocation hooks for RealtimeChecks.
+#define FINGER_REALTIME_HOOKS
 #include <cmath>
+#include <cstdlib>
+#include <cstdio>
 #include <iostream>
 #include <iomanip>
 #include <stdexcept>
@@ -23,6 +27,20 @@
 #include <SFML/Audio.hpp>
 #include <SFML/System.hpp>
 #include <iostream>
+#include "PoseClassifier.h"
+#include "PoseState.h"
+#include "Fusion.h"
+#include "LeapIngest.h"
+#include "Chords.h"
+#include "Mixer.h"
+#include "AudioBackend.h"
+#include "Haptics.h"
+#include "Performance.h"
+#include "Jam.h"
+#include "Midi.h"
+#include "Visualizer.h"
+#include "Wire.h"
+#include "Session.h"
 #define SFML_CLOCK_HPP
 #define SFML_SOUNDBUFFER_HPP
 
@@ -31,12 +49,17 @@ using namespace Leap;
 class DataCollector : public myo::DeviceListener {
 public:
     DataCollector()
-    : onArm(false), isUnlocked(true), roll_w(0), pitch_w(0), yaw_w(0), currentPose()
+    : onArm(false), isUnlocked(true), roll_w(0), pitch_w(0), yaw_w(0), currentPose(), classifiedPose(),
+      streamEmg(false), poseBench(false), training(false), trainingLabel(myo::Pose::rest),
+      fusion(NULL), pitchChangedAt(0), visual(NULL)
     {
     }
     
     void onPair(myo::Myo* myo, uint64_t timestamp, myo::FirmwareVersion firmware_version) {
-        knownMyos.push_back(myo);
+        trackerFor(myo);
+        if (streamEmg) {
+            myo->setStreamEmg(myo::Myo::streamEmgEnabled);
+        }
         std::cout << myo << std::endl;
     }
     
@@ -70,26 +93,53 @@ public:
                           1.0f - 2.0f * (quat.y() * quat.y() + quat.z() * quat.z()));
         
         // Convert the floating point angles in radians to a scale from 0 to 18.
+        int previousPitch = pitch_w;
         roll_w = static_cast<int>((roll + (float)M_PI)/(M_PI * 2.0f) * 18);
         pitch_w = static_cast<int>((pitch + (float)M_PI/2.0f)/M_PI * 18);
         yaw_w = static_cast<int>((yaw + (float)M_PI)/(M_PI * 2.0f) * 18);
+        
+        // Remember when the pitch last moved on the shared timeline; that is the instant of the strum.
+        if (fusion) {
+            int64_t t = fusion->onMyoEvent(timestamp);
+            if (pitch_w != previousPitch) {
+                pitchChangedAt = t;
+            }
+        }
+        if (visual) {
+            visual->post(visualArm, (int) identifyMyo(myo) - 1, hostMicros(), (float) roll_w, (float) pitch_w,
+                         (float) yaw_w);
+        }
     }
     
     // onPose() is called whenever the Myo detects that the person wearing it has changed their pose, for example,
     // making a fist, or not making a fist anymore.
     void onPose(myo::Myo* myo, uint64_t timestamp, myo::Pose pose)
     {
+        PoseTracker& tracker = trackerFor(myo);
         int o = identifyMyo(myo);
         currentPose = pose;
         std::cout << o << std::endl;
         
+        tracker.onFirmwarePose(timestamp, pose.type());
+        if (!tracker.model.trained()) {
+            poses.set(o - 1, pose.type(), timestamp);
+        }
+        if (poseBench && tracker.classifyCount > 0) {
+            std::cout << "classifier: " << tracker.classifyNanos / tracker.classifyCount << " ns/window";
+            if (tracker.leadCount > 0) {
+                std::cout << ", ahead of firmware by " << tracker.leadMicros / tracker.leadCount / 1000
+                          << " ms over " << tracker.leadCount << " poses";
+            }
+            std::cout << std::endl;
+        }
+        
         // Tell the Myo to stay unlocked until told otherwise. We do that here so you can hold the poses without the
         // Myo becoming locked.
-        myo->unlock(myo::Myo::unlockHold);
+        haptics.request(o - 1, hapticUnlock);
         
         // Notify the Myo that the pose has resulted in an action, in this case changing
         // the text on the screen. The Myo will vibrate.
-        myo->notifyUserAction();
+        haptics.request(o - 1, hapticNotify);
         
     }
     
@@ -122,8 +172,19 @@ public:
         isUnlocked = false;
     }
     
-    // There are other virtual functions in DeviceListener that we could override here, like onAccelerometerData().
-    // For this example, the functions overridden above are sufficient.
+    // onEmgData() is called 200 times a second with the raw 8-channel EMG sample when EMG streaming is enabled.
+    // In training mode the windows are recorded with the current label, otherwise they run through this
+    // armband's own classifier, which picks up fist/open well before the firmware pose event arrives.
+    void onEmgData(myo::Myo* myo, uint64_t timestamp, const int8_t* emg)
+    {
+        PoseTracker& tracker = trackerFor(myo);
+        if (training) {
+            tracker.record(trainingLabel, emg);
+        } else if (tracker.onEmg(timestamp, emg)) {
+            classifiedPose = tracker.pose;
+            poses.set(identifyMyo(myo) - 1, tracker.pose, timestamp);
+        }
+    }
     
     // These values are set by onArmSync() and onArmUnsync() above.
     bool onArm;
@@ -136,6 +197,34 @@ public:
     int roll_w, pitch_w, yaw_w;
     myo::Pose currentPose;
     
+    // Set by onEmgData() when a pose model is loaded.
+    myo::Pose classifiedPose;
+    
+    // Active poses per armband and their on/off transitions, fed by whichever of onPose() or onEmgData()
+    // is in charge. This is what the play loop looks at.
+    PoseState poses;
+    // Pose models loaded from --pose-model, one per armband; each goes to its armband's tracker when that
+    // is first seen. An armband without one keeps using the firmware poses.
+    std::vector<PoseClassifier> models;
+    
+    // Commands for the armbands, sent by runMyo() between events rather than from inside the callbacks.
+    HapticQueue haptics;
+    HapticMetronome beats;
+    bool streamEmg;
+    bool poseBench;
+    
+    // Calibration state: while training is set, each armband records its EMG windows as examples of
+    // trainingLabel.
+    bool training;
+    myo::Pose::Type trainingLabel;
+    
+    // Shared timeline for the Myo and Leap streams, and the host time pitch_w last changed.
+    SensorFusion* fusion;
+    int64_t pitchChangedAt;
+    
+    // Stream for the Oculus visualizer, if there is one.
+    VisualizerStream* visual;
+    
     size_t identifyMyo(myo::Myo* myo) {
         for(size_t i = 0; i < knownMyos.size(); i++) {
             if(knownMyos[i] == myo) {
@@ -146,9 +235,84 @@ public:
         return 0;
     }
     
+    // Returns the classifier state for a Myo, registering it if we haven't seen it yet. The first Myo is
+    // usually paired before the collector is added to the hub, so onPair() alone doesn't catch it.
+    PoseTracker& trackerFor(myo::Myo* myo) {
+        size_t id = identifyMyo(myo);
+        if (id == 0) {
+            knownMyos.push_back(myo);
+            trackers.push_back(PoseTracker());
+            id = knownMyos.size();
+            if (id <= models.size()) {
+                trackers[id - 1].model = models[id - 1];
+            }
+        }
+        return trackers[id - 1];
+    }
+    
     std::vector<myo::Myo*> knownMyos;
+    std::vector<PoseTracker> trackers;
 };
 
+// hub.run() for `ms` milliseconds, one event at a time, sending queued haptic commands in between. With a
+// mixer, its metronome beats are turned into pulses too; runOnce() waits at most a few milliseconds so they
+// go out on time even between events.
+void runMyo(myo::Hub& hub, DataCollector& collector, unsigned int ms, Mixer* mixer = NULL)
+{
+    const int64_t sliceMicros = 5000;
+    int64_t until = hostMicros() + (int64_t) ms * 1000;
+    for (int64_t now = hostMicros(); now < until; now = hostMicros()) {
+        int64_t wait = until - now < sliceMicros ? until - now : sliceMicros;
+        hub.runOnce((unsigned int) ((wait + 999) / 1000));
+        now = hostMicros();
+        if (mixer) {
+            Beat beat;
+            while (mixer->pollBeat(beat)) {
+                collector.beats.add(beat);
+            }
+            collector.beats.update(collector.haptics, (int) collector.knownMyos.size(), now);
+        }
+        collector.haptics.drain(collector.knownMyos, now);
+    }
+}
+
+// Calibration mode: prompt for each pose in turn, record labelled EMG windows and fit a pose model for each
+// armband to its own windows.
+void trainPoseModel(myo::Hub& hub, DataCollector& collector, const std::string& path)
+{
+    struct Step {
+        myo::Pose::Type label;
+        const char* prompt;
+    };
+    const Step steps[] = {
+        { myo::Pose::rest, "Relax your hand" },
+        { myo::Pose::fist, "Make a fist" },
+        { myo::Pose::rest, "Relax your hand" },
+        { myo::Pose::fist, "Make a fist" },
+    };
+    
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        std::cout << steps[i].prompt << " and hold it..." << std::endl;
+        runMyo(hub, collector, 1500);
+        collector.trainingLabel = steps[i].label;
+        collector.training = true;
+        runMyo(hub, collector, 4000);
+        collector.training = false;
+    }
+    
+    std::vector<PoseClassifier> models(collector.trackers.size());
+    for (size_t i = 0; i < models.size(); i++) {
+        PoseTracker& tracker = collector.trackers[i];
+        std::cout << "Armband " << i + 1 << ": " << tracker.examples.size() << " windows" << std::endl;
+        models[i].train(tracker.examples);
+    }
+    if (models.empty()) {
+        throw std::runtime_error("No EMG came from the armbands");
+    }
+    savePoseModels(path, models);
+    std::cout << "Saved pose models for " << models.size() << " armbands to " << path << std::endl;
+}
+
 
 class SampleListener : public Listener {
 public:
@@ -163,7 +327,11 @@ public:
     virtual void onServiceConnect(const Controller&);
     virtual void onServiceDisconnect(const Controller&);
     
+    // Written by onFrame() on the Leap thread, read by the fusion loop.
+    LeapFrameQueue frames;
+    
 private:
+    LeapIngest ingest;
 };
 
 void SampleListener::onInit(const Controller& controller) {
@@ -187,89 +355,12 @@ void SampleListener::onExit(const Controller& controller) {
     std::cout << "Exited" << std::endl;
 }
 
+// onFrame() runs on the Leap callback thread for every new frame. It only copies what we need into the
+// queue; the fusion loop in main() picks the records up from there.
 void SampleListener::onFrame(const Controller& controller) {
-    const Frame frame = controller.frame();
-    HandList hands = frame.hands();
-    try {
-        myo::Hub hub("io.github.devinmui.finger");
-        std::cout << "Attempting to find a Myo..." << std::endl;
-            
-        myo::Myo* myo = hub.waitForMyo(10000);
-            
-        if (!myo) {
-            throw std::runtime_error("Unable to find a Myo!");
-        }
-            
-        std::cout << "Connected to a Myo armband!" << std::endl << std::endl;
-    
-        
-        DataCollector collector;
-            
-        hub.addListener(&collector);
-        
-        float pitch = collector.pitch_w;
-        float yaw = collector.yaw_w;
-                
-        for (HandList::const_iterator hl = hands.begin(); hl != hands.end(); hl++) {
-            const Hand hand = *hl;
-            hub.run(1000/20);
-            double foo;
-            if(hand.palmPosition()[2]<0){
-                foo = hand.palmPosition()[2] * -1;
-            } else {
-                foo = hand.palmPosition()[2];
-            }
-            std::cout << collector.whichArm << std::endl;
-            std::cout << std::to_string(foo) << std::endl;
-            std::string pose = collector.currentPose.toString();
-            float init_pitch = collector.pitch_w;
-            float init_yaw = collector.yaw_w;
-            float move_pitch = 0;
-            float move_yaw = 0;
-            if(init_pitch - pitch < 0) {
-                move_pitch = (init_pitch - pitch) * -1;
-            } else {
-                move_pitch = init_pitch - pitch; // calculate the movement of the pitch
-            }
-            if(init_yaw - yaw < 0) {
-                move_yaw = (init_yaw - yaw) * -1; // calculate the movement of the yaw
-            } else {
-                move_yaw = init_yaw - yaw;
-            }
-        
-            // after calculations
-            if(move_pitch >= 1) {
-                std::cout << "YES" << std::endl;
-            } else {
-                std::cout << "NO" << std::endl;
-            }
-                    
-            //std::cout << "pitch: " << init_pitch << ", yaw: "<< init_yaw << std::endl;
-            pitch = init_pitch; // pitch should be around ~ 5+ difference
-            yaw = init_yaw; // yaw should be 1 - 2 difference
-            // whatever might not need yaw or roll just do pitch
-                    
-            if(pose == "fist"){
-                std::cout << "FISTBUMP!" << std::endl;
-                // play music based on calculations from leap motion
-            } else {
-                std::cout << "No fistbump :(" << std::endl;
-            }
-        }
-    } catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
-        std::cerr << "Press enter to continue.";
-        std::cin.ignore()
-        ;
-        //return -1;
-    }
+    ingest.collect(controller, frames);
 }
 
-    
-
-
-
-
 void SampleListener::onFocusGained(const Controller& controller) {
     std::cout << "Focus Gained" << std::endl;
 }
@@ -296,67 +387,112 @@ void SampleListener::onServiceDisconnect(const Controller& controller) {
     std::cout << "Service Disconnected" << std::endl;
 }
 
-void playSound(int inches) {
-    // play music based on calculations from leap motion
-    sf::Clock clock;
-    sf::Time elapsed = clock.getElapsedTime();
-    
-    sf::SoundBuffer buffer;
-    float foo = inches / 4;
-    foo = foo + 0.5;
-    int freq = (int) foo;
-    switch (freq) {
-        case 1:
-            buffer.loadFromFile("1A.wav"); //note file name
-            break;
-        case 2:
-            buffer.loadFromFile("1B.wav"); //note file name
-            break;
-        case 3:
-            buffer.loadFromFile("1C.wav"); //note file name
-            break;
-        case 4:
-            buffer.loadFromFile("1D.wav"); //note file name
-            break;
-        case 5:
-            buffer.loadFromFile("1E.wav"); //note file name
-            break;
-        case 6:
-            buffer.loadFromFile("1F.wav"); //note file name
-            break;
-        case 7:
-            buffer.loadFromFile("1G.wav"); //note file name
-            break;
-        case 8:
-            buffer.loadFromFile("2A.wav"); //note file name
-            break;
-        case 9:
-            buffer.loadFromFile("2B.wav"); //note file name
-            break;
-        case 10:
-            buffer.loadFromFile("2C.wav"); //note file name
-            break;
-        case 11:
-            buffer.loadFromFile("2D.wav"); //note file name
-            break;
-        case 12:
-            buffer.loadFromFile("2E.wav"); //note file name
-            break;
-        case 13:
-            buffer.loadFromFile("2F.wav"); //note file name
-            break;
-        case 14:
-            buffer.loadFromFile("2G.wav"); //note file name
-            break;
+// The detection half of a play loop iteration, once runMyo() has delivered the Myo events: take the Leap
+// frames that arrived since the last one, report fist transitions and hand the arm to the performance. It
+// runs 20 times a second next to the audio, so it must not touch the heap; checkLoopAllocations() runs it
+// under the RealtimeChecks hooks to make sure.
+void playIteration(DataCollector& collector, LeapFrameQueue& frames, SensorFusion& fusion,
+                   Performance& performance, Mixer& mixer, SessionRecorder& recorder)
+{
+    // After the Myo events, so the palm history covers the strum we are about to look at.
+    if (recorder.isOpen()) {
+        drainLeapFrames(frames, fusion, recorder);
+    } else {
+        drainLeapFrames(frames, fusion);
+    }
+    if (performance.visual) {
+        performance.visual->postPalms(fusion.palms);
+    }
+    if (performance.midi) {
+        performance.midi->postPalms(fusion.palms, performance.noteLatency);
+    }
+    PoseEvent event;
+    while (collector.poses.poll(event)) {
+        if (event.pose == myo::Pose::fist && performance.log) {
+            *performance.log << (event.on ? "Fist on " : "Fist off ") << event.device + 1 << std::endl;
+        }
+    }
 
+    ArmState arm;
+    arm.host = hostMicros();
+    arm.pitch = collector.pitch_w;
+    arm.fist = collector.poses.any(myo::Pose::fist);
+    arm.pitchChangedAt = collector.pitchChangedAt;
+    if (recorder.isOpen()) {
+        recorder.arm(arm);
     }
-    
-    sf::Sound sound;
-    sound.setBuffer(buffer);
-    
-    while (elapsed.asSeconds() < 0.25) {
-        sound.play();
-        elapsed = clock.getElapsedTime();
+    performance.update(arm, fusion, mixer);
+}
+
+// --check-allocations: drive playIteration() with made-up poses, strums and hands, chords and open notes
+// alike, and count every allocation, free and lock it makes. A few iterations run first, unchecked, so
+// anything set up on first use is out of the way. Returns false if any iteration touched the heap.
+bool checkLoopAllocations(const NoteBank& bank, const MixerConfig& audio, int64_t noteLatency,
+                          std::ostream& out)
+{
+    const int warmup = 16;
+    const int iterations = 20000;
+    DataCollector collector;
+    LeapFrameQueue frames;
+    SensorFusion fusion;
+    Performance performance(noteLatency);
+    Mixer mixer(bank, audio);
+    SessionRecorder recorder;
+    std::vector<sf::Int16> block(audio.blockFrames * mixerChannels);
+    performance.begin(collector.pitch_w);
+
+    RealtimeChecks::enable();
+    uint64_t violations = 0;
+    for (int i = 0; i < warmup + iterations; i++) {
+        int64_t host = hostMicros();
+        // A hand over the strings most of the time, at a different fret each bar, with a different chord.
+        if (i % 16 < 12) {
+            LeapFrameRecord r = LeapFrameRecord();
+            r.id = i;
+            r.timestamp = r.leapNow = r.hostNow = host;
+            r.hasHand = true;
+            r.palm.z = (float) (i / 16 % 60 + 5);
+            r.features.extended = (uint8_t) (i / 16 % 32);
+            frames.push(r);
+        } else if (i % 16 == 12) {
+            LeapFrameRecord r = LeapFrameRecord();
+            r.id = i;
+            r.timestamp = r.leapNow = r.hostNow = host;
+            frames.push(r);
+        }
+        // Fist for six iterations in eight, strumming up and down while it's held.
+        collector.poses.set(0, i % 8 < 6 ? myo::Pose::fist : myo::Pose::rest, (uint64_t) host);
+        collector.pitch_w = i % 2 ? 12 : 6;
+        collector.pitchChangedAt = host;
+
+        uint64_t before = RealtimeChecks::total();
+        {
+            RealtimeScope scope;
+            playIteration(collector, frames, fusion, performance, mixer, recorder);
+        }
+        if (i >= warmup) {
+            violations += RealtimeChecks::total() - before;
+        }
+        // Keep the mixer's queue moving, as the audio thread would.
+        mixer.render(&block[0], audio.blockFrames);
+    }
+
+    out << "Play loop: " << violations << " allocations, frees or locks in " << iterations << " iterations"
+        << std::endl;
+    if (violations != 0) {
+        RealtimeChecks::report(out, "Play loop and mixer");
+    }
+    return violations == 0;
+}
+
+// Notes from a packed bank if one was given, otherwise from the WAVs next to the binary, keeping only the
+// first headMillis of each in memory if that isn't 0.
+void loadBank(NoteBank& bank, const std::string& path, int headMillis)
+{
+    if (path.empty()) {
+        bank.load(".", headMillis);
+    } else {
+        bank.loadPacked(path);
     }
 }
 
@@ -365,8 +501,332 @@ int main(int argc, char** argv)
     SampleListener listener;
     Controller controller;
     
+    // --train-pose <file>: record calibration data and save a pose model for each armband
+    // --pose-model <file>: take fist/open from our EMG classifiers instead of the firmware
+    // --pose-bench: print classifier timing and how far it runs ahead of the firmware poses
+    // --note-latency <ms>: fixed delay from the strum to the note; long enough to cover one loop iteration
+    //                      so every note sounds the same time after its strum
+    // --block <frames>: audio block size; smaller is lower latency but more callbacks to keep up with
+    // --buffers <n>: audio blocks queued ahead of the device, for latency and underrun accounting; the sfml
+    //               backend always queues 3
+    // --audio-stats: print block timing, underrun, haptic, jam and MIDI counters once a second
+    // --audio sfml|alsa|null: output backend; alsa needs a Linux build with FINGER_ALSA defined, null renders
+    //                         without a device
+    // --latency-test: time notes from queuing to output on each audio backend and exit
+    // --adsr <attack ms>:<decay ms>:<sustain 0-1>:<release ms>: note envelope
+    // --linear-envelope: straight envelope segments instead of exponential curves
+    // --steal oldest|quietest|retrigger: which voice a note cuts off once all are playing; retrigger also
+    //                                    restarts a note that is still ringing instead of doubling it
+    // --drive <dB>: overdrive the mix, with this much gain into the clipper
+    // --cabinet <ir.wav>: convolve the mix with a speaker cabinet impulse response
+    // --reverb <level 0-1>[:<seconds>]: add reverb, optionally with its decay time
+    // --metronome <bpm>[:<beats per bar>]: pulse the armbands on each beat, counted from the audio output
+    // --click <level 0-1>: also click on each beat, at this level
+    // --visualizer <host>[:<port>]: stream notes, strums, palm and arm movement to the Oculus visualizer
+    // --visualizer-listen <port>: print what a visualizer would receive on this port
+    // --visualizer-loopback: stream made-up play to a receiver in this process and report loss and delay
+    // --jam <port>: play along with other rigs, listening on this port
+    // --jam-peer <host>[:<port>]: another rig in the session; give one for each
+    // --jam-buffer <ms>: fixed delay on notes from the other rigs, to ride out network jitter
+    // --jam-skew <ms>: shift this rig's session clock, to try the clock sync with every rig on one machine
+    // --jam-test <seconds>: strum made-up chords into the session without the sensors, then report delivery
+    //                       and latency; run one per port on one machine to test over loopback
+    // --midi alsa[:<client>:<port>]|<file.mid>: also play the notes over MIDI, with velocity from the strum
+    //                                        and pitch bend from the palm sliding along the neck, on an
+    //                                        ALSA sequencer port (a FINGER_ALSA build) or into a MIDI file
+    // --midi-channel <1-16>: MIDI channel to play on
+    // --midi-test <seconds>: send made-up strums and bends to the --midi output without the sensors, then
+    //                        report batching and send latency
+    // --wire-bench: time packing network events with the wire structs against sf::Packet and exit
+    // --effects-bench: time the effects per 256-frame block and exit
+    // --bank <file>: map notes from a packed bank instead of decoding the WAVs
+    // --pack-bank <dir> <file>: pack the note WAVs in dir into a bank for --bank
+    // --stream-head <ms>: keep only the start of each note WAV in memory and stream the rest from disk
+    //                     (a packed bank is already paged in on demand)
+    // --record-session <file>: save what the sensors did, for --render
+    // --render <session> <out.wav>: play a recorded session offline into a WAV file
+    // --check-render <session> <golden.wav>: render a session and fail if it doesn't match a previous render
+    // --rt-checks: report any allocation or lock on the audio thread, with where it happened
+    // --check-realtime <session>: render a session and fail if the mixer allocated or locked while rendering
+    // --check-allocations: run the play loop on made-up input and fail if it allocated or locked
+    std::string trainPath;
+    std::string modelPath;
+    bool poseBench = false;
+    int64_t noteLatency = 60000;
+    MixerConfig audio;
+    bool audioStats = false;
+    std::string audioBackend = "sfml";
+    bool latencyTest = false;
+    std::string cabinetPath;
+    bool effectsBench = false;
+    std::string visualizerHost;
+    unsigned short visualizerPort = ::visualizerPort;
+    int visualizerListen = -1;
+    bool visualizerLoopback = false;
+    JamConfig jam;
+    int jamTest = 0;
+    std::string midiTarget;
+    MidiConfig midiConfig;
+    int midiTest = 0;
+    bool wireBench = false;
+    std::string bankPath;
+    std::string packDir;
+    int streamHead = 0;
+    std::string sessionPath;
+    std::string renderPath;
+    std::string goldenPath;
+    bool realtimeChecks = false;
+    std::string realtimeSession;
+    bool allocationCheck = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--train-pose" && i + 1 < argc) {
+            trainPath = argv[++i];
+        } else if (arg == "--pose-model" && i + 1 < argc) {
+            modelPath = argv[++i];
+        } else if (arg == "--pose-bench") {
+            poseBench = true;
+        } else if (arg == "--note-latency" && i + 1 < argc) {
+            noteLatency = atoi(argv[++i]) * (int64_t) 1000;
+        } else if (arg == "--block" && i + 1 < argc) {
+            audio.blockFrames = atoi(argv[++i]);
+        } else if (arg == "--buffers" && i + 1 < argc) {
+            audio.queuedBuffers = atoi(argv[++i]);
+        } else if (arg == "--audio-stats") {
+            audioStats = true;
+        } else if (arg == "--audio" && i + 1 < argc) {
+            audioBackend = argv[++i];
+        } else if (arg == "--latency-test") {
+            latencyTest = true;
+        } else if (arg == "--adsr" && i + 1 < argc) {
+            float a, d, s, r;
+            if (sscanf(argv[++i], "%f:%f:%f:%f", &a, &d, &s, &r) != 4 || s < 0 || s > 1) {
+                std::cerr << "--adsr wants attack:decay:sustain:release, e.g. 2:300:0.6:150" << std::endl;
+                return -1;
+            }
+            audio.envelope.attack = a / 1000;
+            audio.envelope.decay = d / 1000;
+            audio.envelope.sustain = s;
+            audio.envelope.release = r / 1000;
+        } else if (arg == "--linear-envelope") {
+            audio.envelope.exponential = false;
+        } else if (arg == "--steal" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if (policy == "oldest") {
+                audio.steal = stealOldest;
+            } else if (policy == "quietest") {
+                audio.steal = stealQuietest;
+            } else if (policy == "retrigger") {
+                audio.steal = stealSameNote;
+            } else {
+                std::cerr << "--steal wants oldest, quietest or retrigger" << std::endl;
+                return -1;
+            }
+        } else if (arg == "--drive" && i + 1 < argc) {
+            audio.effects.overdrive = true;
+            audio.effects.drive = (float) atof(argv[++i]);
+        } else if (arg == "--cabinet" && i + 1 < argc) {
+            cabinetPath = argv[++i];
+        } else if (arg == "--reverb" && i + 1 < argc) {
+            float level, seconds;
+            int n = sscanf(argv[++i], "%f:%f", &level, &seconds);
+            if (n < 1 || level < 0 || level > 1 || (n == 2 && seconds <= 0)) {
+                std::cerr << "--reverb wants a level from 0 to 1, optionally :seconds, e.g. 0.3:2" << std::endl;
+                return -1;
+            }
+            audio.effects.reverb = level;
+            if (n == 2) {
+                audio.effects.reverbTime = seconds;
+            }
+        } else if (arg == "--metronome" && i + 1 < argc) {
+            double bpm;
+            int beats;
+            int n = sscanf(argv[++i], "%lf:%d", &bpm, &beats);
+            if (n < 1 || bpm <= 0 || bpm > Metronome::maxBpm || (n == 2 && beats < 1)) {
+                std::cerr << "--metronome wants a tempo up to " << Metronome::maxBpm
+                          << " bpm, optionally :beats per bar, e.g. 96:4" << std::endl;
+                return -1;
+            }
+            audio.metronome.bpm = bpm;
+            if (n == 2) {
+                audio.metronome.beatsPerBar = beats;
+            }
+        } else if (arg == "--click" && i + 1 < argc) {
+            audio.metronome.click = (float) atof(argv[++i]);
+        } else if (arg == "--visualizer" && i + 1 < argc) {
+            std::string target = argv[++i];
+            size_t colon = target.find(':');
+            visualizerHost = target.substr(0, colon);
+            if (colon != std::string::npos) {
+                visualizerPort = (unsigned short) atoi(target.c_str() + colon + 1);
+            }
+        } else if (arg == "--visualizer-listen" && i + 1 < argc) {
+            visualizerListen = atoi(argv[++i]);
+        } else if (arg == "--visualizer-loopback") {
+            visualizerLoopback = true;
+        } else if (arg == "--jam" && i + 1 < argc) {
+            jam.port = (unsigned short) atoi(argv[++i]);
+        } else if (arg == "--jam-peer" && i + 1 < argc) {
+            jam.peers.push_back(argv[++i]);
+        } else if (arg == "--jam-buffer" && i + 1 < argc) {
+            jam.buffer = atoi(argv[++i]) * (int64_t) 1000;
+        } else if (arg == "--jam-skew" && i + 1 < argc) {
+            jam.skew = atoi(argv[++i]) * (int64_t) 1000;
+        } else if (arg == "--jam-test" && i + 1 < argc) {
+            jamTest = atoi(argv[++i]);
+        } else if (arg == "--midi" && i + 1 < argc) {
+            midiTarget = argv[++i];
+        } else if (arg == "--midi-channel" && i + 1 < argc) {
+            int channel = atoi(argv[++i]);
+            if (channel < 1 || channel > 16) {
+                std::cerr << "--midi-channel wants a channel from 1 to 16" << std::endl;
+                return -1;
+            }
+            midiConfig.channel = channel - 1;
+        } else if (arg == "--midi-test" && i + 1 < argc) {
+            midiTest = atoi(argv[++i]);
+        } else if (arg == "--wire-bench") {
+            wireBench = true;
+        } else if (arg == "--effects-bench") {
+            effectsBench = true;
+        } else if (arg == "--bank" && i + 1 < argc) {
+            bankPath = argv[++i];
+        } else if (arg == "--pack-bank" && i + 2 < argc) {
+            packDir = argv[++i];
+            bankPath = argv[++i];
+        } else if (arg == "--stream-head" && i + 1 < argc) {
+            streamHead = atoi(argv[++i]);
+        } else if (arg == "--record-session" && i + 1 < argc) {
+            sessionPath = argv[++i];
+        } else if (arg == "--render" && i + 2 < argc) {
+            sessionPath = argv[++i];
+            renderPath = argv[++i];
+        } else if (arg == "--check-render" && i + 2 < argc) {
+            sessionPath = argv[++i];
+            goldenPath = argv[++i];
+        } else if (arg == "--rt-checks") {
+            realtimeChecks = true;
+        } else if (arg == "--check-realtime" && i + 1 < argc) {
+            realtimeSession = argv[++i];
+        } else if (arg == "--check-allocations") {
+            allocationCheck = true;
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return -1;
+        }
+    }
     
     try {
+        if (!cabinetPath.empty()) {
+            loadImpulse(cabinetPath, audio.effects.cabinet);
+        }
+        if (effectsBench) {
+            benchmarkEffects(audio.effects, std::cout);
+            return 0;
+        }
+        if (wireBench) {
+            benchmarkWire(std::cout);
+            return 0;
+        }
+        if (midiTest > 0) {
+            if (midiTarget.empty()) {
+                std::cerr << "--midi-test needs a --midi output" << std::endl;
+                return -1;
+            }
+            MidiStream midi(midiConfig);
+            midi.open(createMidiSink(midiTarget));
+            midi.start();
+            runMidiTest(midi, midiTest, noteLatency, std::cout);
+            return 0;
+        }
+        if (visualizerLoopback) {
+            loopbackVisualizerTest(std::cout);
+            return 0;
+        }
+        if (visualizerListen >= 0) {
+            listenVisualizer((unsigned short) visualizerListen, std::cout);
+            return 0;
+        }
+        
+        if (!packDir.empty()) {
+            packNoteBank(packDir, bankPath);
+            std::cout << "Packed " << noteCount << " notes into " << bankPath << std::endl;
+            return 0;
+        }
+        
+        if (!renderPath.empty() || !goldenPath.empty()) {
+            NoteBank bank;
+            // Streaming would make the render depend on the disk, so offline everything is resident.
+            loadBank(bank, bankPath, 0);
+            SessionRender render;
+            renderSession(sessionPath, bank, audio, render);
+            double length = (double) render.samples.size() / mixerChannels / mixerSampleRate;
+            std::cout << render.notes << " notes, " << length << " s of audio in " << render.seconds << " s ("
+                      << length / render.seconds << "x real time), " << render.stats.lateNotes << " late"
+                      << std::endl;
+            if (!renderPath.empty()) {
+                writeWav(renderPath, render.samples);
+                return 0;
+            }
+            // Mixing is deterministic, but leave a step of slack for a different compiler's float rounding.
+            int64_t frame;
+            int diff = compareWav(goldenPath, render.samples, 1, frame);
+            if (frame >= 0) {
+                std::cerr << "Render differs from " << goldenPath << " at frame " << frame << " (by up to "
+                          << diff << ")" << std::endl;
+                return 1;
+            }
+            std::cout << "Render matches " << goldenPath << std::endl;
+            return 0;
+        }
+        
+        if (latencyTest) {
+            NoteBank bank;
+            loadBank(bank, bankPath, 0);
+            compareOutputLatency(bank, audio, std::cout);
+            return 0;
+        }
+        
+        MixerConfig device = backendConfig(audioBackend, audio);
+        if (device.queuedBuffers != audio.queuedBuffers) {
+            std::cerr << "The " << audioBackend << " backend always queues " << device.queuedBuffers
+                      << " buffers; ignoring --buffers" << std::endl;
+            audio = device;
+        }
+        
+        if (jamTest > 0) {
+            if (jam.peers.empty()) {
+                std::cerr << "--jam-test needs at least one --jam-peer" << std::endl;
+                return -1;
+            }
+            NoteBank bank;
+            loadBank(bank, bankPath, streamHead);
+            Mixer mixer(bank, audio);
+            std::unique_ptr<AudioBackend> output = createAudioBackend(audioBackend, mixer, audio);
+            output->start();
+            JamSession session(mixer);
+            session.open(jam);
+            session.start();
+            runJamTest(session, mixer, jamTest, noteLatency, std::cout);
+            return 0;
+        }
+        
+        if (!realtimeSession.empty()) {
+            NoteBank bank;
+            loadBank(bank, bankPath, 0);
+            RealtimeChecks::enable();
+            SessionRender render;
+            renderSession(realtimeSession, bank, audio, render);
+            RealtimeChecks::report(std::cout);
+            return RealtimeChecks::total() == 0 ? 0 : 1;
+        }
+        
+        if (allocationCheck) {
+            NoteBank bank;
+            loadBank(bank, bankPath, 0);
+            return checkLoopAllocations(bank, audio, noteLatency, std::cout) ? 0 : 1;
+        }
+        
         myo::Hub hub("io.github.devinmui.finger");
         std::cout << "Attempting to find a Myo..." << std::endl;
         
@@ -380,56 +840,95 @@ int main(int argc, char** argv)
         
         
         DataCollector collector;
+        collector.poseBench = poseBench;
+        if (!modelPath.empty()) {
+            loadPoseModels(modelPath, collector.models);
+        }
+        if (!trainPath.empty() || !modelPath.empty()) {
+            collector.streamEmg = true;
+            myo->setStreamEmg(myo::Myo::streamEmgEnabled);
+        }
         
         hub.addListener(&collector);
         
-        float pitch = collector.pitch_w;
-        float yaw = collector.yaw_w;
+        if (!trainPath.empty()) {
+            trainPoseModel(hub, collector, trainPath);
+            return 0;
+        }
+        
+        SensorFusion fusion;
+        collector.fusion = &fusion;
+        controller.addListener(listener);
+        
+        NoteBank bank;
+        loadBank(bank, bankPath, streamHead);
+        Mixer mixer(bank, audio);
+        std::unique_ptr<AudioBackend> output = createAudioBackend(audioBackend, mixer, audio);
+        if (realtimeChecks) {
+            RealtimeChecks::enable();
+        }
+        output->start();
+        std::cout << "Audio: " << output->name() << ", " << audio.blockFrames << " frames x "
+                  << audio.queuedBuffers << " buffers, "
+                  << audio.blockFrames * audio.queuedBuffers * 1000.0 / mixerSampleRate << " ms" << std::endl;
+        VisualizerStream visual;
+        if (!visualizerHost.empty()) {
+            visual.open(sf::IpAddress(visualizerHost), visualizerPort);
+            visual.start();
+            collector.visual = &visual;
+        }
+        JamSession session(mixer);
+        if (!jam.peers.empty()) {
+            session.open(jam);
+            session.start();
+        }
+        Performance performance(noteLatency);
+        performance.log = &std::cout;
+        performance.visual = visual.isOpen() ? &visual : NULL;
+        performance.jam = session.isOpen() ? &session : NULL;
+        MidiStream midi(midiConfig);
+        if (!midiTarget.empty()) {
+            midi.open(createMidiSink(midiTarget));
+            midi.start();
+            performance.midi = &midi;
+            std::cout << "MIDI: " << midi.sinkName() << std::endl;
+        }
+        performance.begin(collector.pitch_w);
+        SessionRecorder recorder;
+        if (!sessionPath.empty()) {
+            recorder.open(sessionPath, noteLatency);
+            recorder.begin(hostMicros(), collector.pitch_w);
+        }
+        
+        int iteration = 0;
+        uint64_t realtimeViolations = 0;
         while(1){
-            const Frame frame = controller.frame();
-            double foo = 0;
-            HandList hands = frame.hands();
-            for (HandList::const_iterator hl = hands.begin(); hl != hands.end(); hl++) {
-                const Hand hand = *hl;
-                foo = hand.palmPosition()[2];
-                std::cout << std::to_string(foo) << std::endl;
-            }
-            if(foo < 0){
-                foo = foo * -1;
-            }
-            hub.run(1000/20);
-            std::string pose = collector.currentPose.toString();
-            float init_pitch = collector.pitch_w;
-            float init_yaw = collector.yaw_w;
-            float move_pitch = 0;
-            float move_yaw = 0;
-            if(init_pitch - pitch < 0) {
-                move_pitch = (init_pitch - pitch) * -1;
-            } else {
-                move_pitch = init_pitch - pitch; // calculate the movement of the pitch
+            runMyo(hub, collector, 1000/20, &mixer);
+            
+            if (realtimeChecks && RealtimeChecks::total() != realtimeViolations) {
+                realtimeViolations = RealtimeChecks::total();
+                RealtimeChecks::report(std::cout);
             }
-            if(init_yaw - yaw < 0) {
-                move_yaw = (init_yaw - yaw) * -1; // calculate the movement of the yaw
-            } else {
-                move_yaw = init_yaw - yaw;
+            if (audioStats && ++iteration % 20 == 0) {
+                MixerStats stats = mixer.stats();
+                std::cout << "Audio: " << stats.blocks << " blocks, " << stats.underruns << " underruns, "
+                          << stats.lateBlocks << " late, render " << stats.renderNanosLast / 1000 << " us (max "
+                          << stats.renderNanosMax / 1000 << " us, mean "
+                          << (stats.blocks ? stats.renderNanosTotal / stats.blocks / 1000 : 0) << " us), notes "
+                          << stats.lateNotes << " late " << stats.droppedNotes << " dropped " << stats.steals
+                          << " stolen, " << stats.starvedFrames << " frames waiting on disk" << std::endl;
+                HapticStats haptic = collector.haptics.stats();
+                std::cout << "Haptics: " << haptic.sent << " sent of " << haptic.requested << " requested, "
+                          << haptic.coalesced << " coalesced, " << haptic.deferred << " deferred, send "
+                          << (haptic.sent ? haptic.sendNanosTotal / haptic.sent / 1000 : 0) << " us (max "
+                          << haptic.sendNanosMax / 1000 << " us)" << std::endl;
+                printJamStats(session, std::cout);
+                if (midi.isOpen()) {
+                    printMidiStats(midi.stats(), std::cout);
+                }
             }
             
-            //std::cout << "pitch: " << init_pitch << ", yaw: "<< init_yaw << std::endl;
-            pitch = init_pitch; // pitch should be around ~ 5+ difference
-            yaw = init_yaw; // yaw should be 1 - 2 difference
-            // whatever might not need yaw or roll just do pitch
-            
-            if(pose == "fist" && move_pitch >= 1 && foo > 0){
-                std::cout << "FISTBUMP!" << std::endl;
-                //playSound((int) (foo+0.5));
-                std::future<void> result(std::async(playSound, (int) foo + 0.5));
-                result.get();
-            } else if(pose == "fist" && move_pitch >= 1) {
-                //playSound((int) (); // open note lel
-                std::future<void> result(std::async(playSound, (int) (rand() % 64 + 4) + 0.5));
-                result.get();
-                std::cout << ":(" << std::endl;
-            }
+            playIteration(collector, listener.frames, fusion, performance, mixer, recorder);
         
         }
         } catch (const std::exception& e) {